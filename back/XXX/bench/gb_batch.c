@@ -0,0 +1,282 @@
+/* Headless batch runner: emulates many ROMs in the same process, one
+ * `struct gb` instance per worker thread, without any video or audio
+ * output.
+ *
+ * For every ROM it prints the number of frames displayed and a hash of all
+ * the lines drawn by the GPU, which makes it easy to spot a behavior change
+ * across a large set of ROMs. With -r each instance draws its lines in its
+ * own GPU render thread, which must give the same hashes.
+ *
+ * Build it with every file in src/ except main.c and sdl.c, for instance:
+ *
+ *   cc -O2 -Isrc -o gb_batch bench/gb_batch.c \
+ *      $(ls src/[a-z]*.c | grep -v -e main.c -e sdl.c) -lpthread -lm
+ *
+ * Note that fatal emulation errors (invalid ROM, unsupported cartridge...)
+ * still terminate the whole process.
+ */
+#include <string.h>
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "gb.h"
+
+/* Number of cycles in one full frame (154 lines of 456 cycles) */
+#define GB_BATCH_FRAME_CYCLES (456U * 154U)
+
+/* Number of frames emulated for each ROM by default: one minute of emulated
+ * time */
+#define GB_BATCH_DEFAULT_FRAMES 3600U
+
+/* FNV-1a parameters used to hash the video output */
+#define GB_BATCH_HASH_INIT  0xcbf29ce484222325ULL
+#define GB_BATCH_HASH_PRIME 0x100000001b3ULL
+
+/* Result of the emulation of one ROM */
+struct gb_batch_job {
+     const char *rom_file;
+     /* Number of frames the GPU sent to the frontend */
+     unsigned long flips;
+     /* Hash of every line drawn by the GPU */
+     uint64_t hash;
+     /* Number of cycles actually emulated */
+     uint64_t cycles;
+};
+
+/* State shared by all the worker threads */
+struct gb_batch {
+     struct gb_batch_job *jobs;
+     unsigned n_jobs;
+     /* Index of the next job to be picked up by a worker */
+     unsigned next_job;
+     pthread_mutex_t lock;
+     unsigned long frames;
+     /* True if the GPU draws the lines in its render thread */
+     bool render_thread;
+};
+
+static uint64_t gb_batch_hash(uint64_t hash, uint16_t v) {
+     hash = (hash ^ (v & 0xff)) * GB_BATCH_HASH_PRIME;
+     hash = (hash ^ (v >> 8)) * GB_BATCH_HASH_PRIME;
+
+     return hash;
+}
+
+static void gb_batch_draw_line_dmg(struct gb *gb, unsigned ly,
+                                   union gb_gpu_color line[GB_LCD_WIDTH]) {
+     struct gb_batch_job *job = gb->frontend.data;
+
+     for (unsigned i = 0; i < GB_LCD_WIDTH; i++) {
+          job->hash = gb_batch_hash(job->hash, line[i].dmg_color);
+     }
+}
+
+static void gb_batch_draw_line_gbc(struct gb *gb, unsigned ly,
+                                   union gb_gpu_color line[GB_LCD_WIDTH]) {
+     struct gb_batch_job *job = gb->frontend.data;
+
+     for (unsigned i = 0; i < GB_LCD_WIDTH; i++) {
+          job->hash = gb_batch_hash(job->hash, line[i].gbc_color);
+     }
+}
+
+static void gb_batch_flip(struct gb *gb) {
+     struct gb_batch_job *job = gb->frontend.data;
+
+     job->flips++;
+}
+
+static void gb_batch_refresh_input(struct gb *gb) {
+}
+
+static void gb_batch_destroy(struct gb *gb) {
+     gb->frontend.data = NULL;
+}
+
+static void gb_batch_frontend_init(struct gb *gb, struct gb_batch_job *job) {
+     job->flips = 0;
+     job->hash = GB_BATCH_HASH_INIT;
+     job->cycles = 0;
+
+     gb->frontend.draw_line_dmg = gb_batch_draw_line_dmg;
+     gb->frontend.draw_line_gbc = gb_batch_draw_line_gbc;
+     gb->frontend.flip = gb_batch_flip;
+     gb->frontend.refresh_input = gb_batch_refresh_input;
+     gb->frontend.destroy = gb_batch_destroy;
+     gb->frontend.data = job;
+}
+
+/* Emulate `job->rom_file` for `frames` frames in a fresh instance */
+static void gb_batch_run_job(struct gb_batch_job *job, unsigned long frames,
+                             bool render_thread) {
+     uint64_t total_cycles = (uint64_t)frames * GB_BATCH_FRAME_CYCLES;
+     struct gb *gb = calloc(1, sizeof(*gb));
+
+     if (gb == NULL) {
+          perror("calloc failed");
+          die();
+     }
+     gb->cpu.memory = gb;
+
+     gb_batch_frontend_init(gb, job);
+
+     gb_cart_load(gb, job->rom_file);
+     gb_sync_reset(gb);
+     gb_irq_reset(gb);
+     gb_cpu_reset(gb);
+     gb_gpu_reset(gb);
+     gb_input_reset(gb);
+     gb_dma_reset(gb);
+     gb_timer_reset(gb);
+     gb_spu_reset(gb);
+     gb_memory_reset(gb);
+
+     gb->quit = false;
+     gb->double_speed = false;
+     gb->speed_switch_pending = false;
+
+     if (render_thread) {
+          gb_gpu_start_render_thread(gb);
+     }
+
+     while (!gb->quit && job->cycles < total_cycles) {
+          gb->frontend.refresh_input(gb);
+          job->cycles += gb_cpu_run_cycles(gb, GB_CPU_FREQ_HZ / 120);
+     }
+
+     gb_gpu_stop_render_thread(gb);
+
+     gb->frontend.destroy(gb);
+     gb_cart_unload(gb);
+
+     free(gb);
+}
+
+static void *gb_batch_worker(void *data) {
+     struct gb_batch *batch = data;
+
+     for (;;) {
+          unsigned j;
+
+          pthread_mutex_lock(&batch->lock);
+          j = batch->next_job;
+          if (j < batch->n_jobs) {
+               batch->next_job++;
+          }
+          pthread_mutex_unlock(&batch->lock);
+
+          if (j >= batch->n_jobs) {
+               return NULL;
+          }
+
+          gb_batch_run_job(&batch->jobs[j], batch->frames,
+                           batch->render_thread);
+     }
+}
+
+static double gb_batch_now(void) {
+     struct timespec ts;
+
+     clock_gettime(CLOCK_MONOTONIC, &ts);
+
+     return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void gb_batch_usage(const char *prog) {
+     fprintf(stderr, "Usage: %s [-r] [-j threads] [-n frames] <rom>...\n", prog);
+}
+
+int main(int argc, char **argv) {
+     struct gb_batch batch;
+     pthread_t *threads;
+     unsigned long n_threads;
+     uint64_t total_cycles = 0;
+     double start;
+     double wall;
+     int opt;
+
+     gb_cpu_init();
+
+     n_threads = sysconf(_SC_NPROCESSORS_ONLN);
+     batch.frames = GB_BATCH_DEFAULT_FRAMES;
+     batch.render_thread = false;
+
+     while ((opt = getopt(argc, argv, "rj:n:")) != -1) {
+          switch (opt) {
+          case 'r':
+               batch.render_thread = true;
+               break;
+          case 'j':
+               n_threads = strtoul(optarg, NULL, 0);
+               break;
+          case 'n':
+               batch.frames = strtoul(optarg, NULL, 0);
+               break;
+          default:
+               gb_batch_usage(argv[0]);
+               return EXIT_FAILURE;
+          }
+     }
+
+     if (optind >= argc || n_threads == 0 || batch.frames == 0) {
+          gb_batch_usage(argv[0]);
+          return EXIT_FAILURE;
+     }
+
+     batch.n_jobs = argc - optind;
+     batch.next_job = 0;
+     batch.jobs = calloc(batch.n_jobs, sizeof(*batch.jobs));
+     if (batch.jobs == NULL) {
+          perror("calloc failed");
+          return EXIT_FAILURE;
+     }
+
+     for (unsigned i = 0; i < batch.n_jobs; i++) {
+          batch.jobs[i].rom_file = argv[optind + i];
+     }
+
+     if (n_threads > batch.n_jobs) {
+          n_threads = batch.n_jobs;
+     }
+
+     threads = calloc(n_threads, sizeof(*threads));
+     if (threads == NULL) {
+          perror("calloc failed");
+          return EXIT_FAILURE;
+     }
+
+     pthread_mutex_init(&batch.lock, NULL);
+
+     start = gb_batch_now();
+
+     for (unsigned long i = 0; i < n_threads; i++) {
+          if (pthread_create(&threads[i], NULL, gb_batch_worker, &batch)) {
+               perror("pthread_create failed");
+               return EXIT_FAILURE;
+          }
+     }
+
+     for (unsigned long i = 0; i < n_threads; i++) {
+          pthread_join(threads[i], NULL);
+     }
+
+     wall = gb_batch_now() - start;
+
+     for (unsigned i = 0; i < batch.n_jobs; i++) {
+          struct gb_batch_job *job = &batch.jobs[i];
+
+          printf("%s: %lu frames displayed, hash %016llx\n",
+                 job->rom_file, job->flips, (unsigned long long)job->hash);
+          total_cycles += job->cycles;
+     }
+
+     printf("Ran %u ROMs on %lu threads in %.3fs (%.2f emulated MHz)\n",
+            batch.n_jobs, n_threads, wall, total_cycles / wall / 1e6);
+
+     pthread_mutex_destroy(&batch.lock);
+     free(threads);
+     free(batch.jobs);
+
+     return 0;
+}
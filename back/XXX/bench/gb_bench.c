@@ -0,0 +1,175 @@
+/* Headless benchmark: runs a ROM as fast as possible without any video or
+ * audio output and reports the raw throughput of the emulation core. With -r
+ * the lines are drawn by the GPU render thread instead of inline, with
+ * -f <skip>/<period> the GPU skips `skip` frames out of every `period`.
+ *
+ * Build it with every file in src/ except main.c and sdl.c, for instance:
+ *
+ *   cc -O2 -Isrc -o gb_bench bench/gb_bench.c \
+ *      $(ls src/[a-z]*.c | grep -v -e main.c -e sdl.c) -lpthread -lm
+ */
+#include <string.h>
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+#include "gb.h"
+
+/* Number of cycles in one full frame (154 lines of 456 cycles) */
+#define GB_BENCH_FRAME_CYCLES (456U * 154U)
+
+/* Number of frames emulated by default: one minute of emulated time */
+#define GB_BENCH_DEFAULT_FRAMES 3600U
+
+struct gb_bench_context {
+     /* Number of frames the GPU sent to the frontend */
+     unsigned long flips;
+};
+
+static void gb_bench_draw_line(struct gb *gb, unsigned ly,
+                               union gb_gpu_color line[GB_LCD_WIDTH]) {
+}
+
+static void gb_bench_flip(struct gb *gb) {
+     struct gb_bench_context *ctx = gb->frontend.data;
+
+     ctx->flips++;
+}
+
+static void gb_bench_refresh_input(struct gb *gb) {
+}
+
+static void gb_bench_destroy(struct gb *gb) {
+     gb->frontend.data = NULL;
+}
+
+static void gb_bench_frontend_init(struct gb *gb,
+                                   struct gb_bench_context *ctx) {
+     ctx->flips = 0;
+
+     gb->frontend.draw_line_dmg = gb_bench_draw_line;
+     gb->frontend.draw_line_gbc = gb_bench_draw_line;
+     gb->frontend.flip = gb_bench_flip;
+     gb->frontend.refresh_input = gb_bench_refresh_input;
+     gb->frontend.destroy = gb_bench_destroy;
+     gb->frontend.data = ctx;
+}
+
+static double gb_bench_now(void) {
+     struct timespec ts;
+
+     clock_gettime(CLOCK_MONOTONIC, &ts);
+
+     return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char **argv) {
+    struct gb_bench_context ctx;
+    unsigned long frames = GB_BENCH_DEFAULT_FRAMES;
+    uint64_t total_cycles;
+    uint64_t elapsed_cycles;
+    double start;
+    double wall;
+    double emulated;
+    bool render_thread = false;
+    unsigned skip_frames = 0;
+    unsigned skip_period = 0;
+    int opt;
+
+    gb_cpu_init();
+
+    while ((opt = getopt(argc, argv, "rf:")) != -1) {
+        switch (opt) {
+        case 'r':
+            render_thread = true;
+            break;
+        case 'f':
+            if (sscanf(optarg, "%u/%u", &skip_frames, &skip_period) != 2 ||
+                skip_period == 0) {
+                fprintf(stderr, "Invalid frame skip '%s'\n", optarg);
+                return EXIT_FAILURE;
+            }
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-r] [-f skip/period] <rom> [frames]\n", argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (argc - optind < 1 || argc - optind > 2) {
+        fprintf(stderr, "Usage: %s [-r] [-f skip/period] <rom> [frames]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    if (argc - optind == 2) {
+        frames = strtoul(argv[optind + 1], NULL, 0);
+        if (frames == 0) {
+            fprintf(stderr, "Invalid frame count '%s'\n", argv[optind + 1]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    struct gb *gb = calloc(1, sizeof(*gb));
+    if (gb == NULL) {
+        perror("calloc failed");
+        return EXIT_FAILURE;
+    }
+    gb->cpu.memory = gb;
+
+    gb_bench_frontend_init(gb, &ctx);
+    gb->gpu.skip_frames = skip_frames;
+    gb->gpu.skip_period = skip_period;
+
+    const char *rom_file = argv[optind];
+    gb_cart_load(gb, rom_file);
+    gb_sync_reset(gb);
+    gb_irq_reset(gb);
+    gb_cpu_reset(gb);
+    gb_gpu_reset(gb);
+    gb_input_reset(gb);
+    gb_dma_reset(gb);
+    gb_timer_reset(gb);
+    gb_spu_reset(gb);
+    gb_memory_reset(gb);
+
+    gb->quit = false;
+    gb->double_speed = false;
+    gb->speed_switch_pending = false;
+
+    if (render_thread) {
+        gb_gpu_start_render_thread(gb);
+    }
+
+    total_cycles = (uint64_t)frames * GB_BENCH_FRAME_CYCLES;
+    elapsed_cycles = 0;
+
+    start = gb_bench_now();
+
+    while (!gb->quit && elapsed_cycles < total_cycles) {
+         gb->frontend.refresh_input(gb);
+
+         /* Same granularity as the interactive frontend so that we measure
+          * the same code path */
+         elapsed_cycles += gb_cpu_run_cycles(gb, GB_CPU_FREQ_HZ / 120);
+    }
+
+    /* Wait for the render thread to catch up */
+    gb_gpu_stop_render_thread(gb);
+
+    wall = gb_bench_now() - start;
+    emulated = (double)elapsed_cycles / GB_CPU_FREQ_HZ;
+
+    printf("Emulated %lu frames (%llu cycles, %lu displayed) in %.3fs\n",
+           (unsigned long)(elapsed_cycles / GB_BENCH_FRAME_CYCLES),
+           (unsigned long long)elapsed_cycles, ctx.flips, wall);
+    printf("Emulated MHz:  %.2f\n", elapsed_cycles / wall / 1e6);
+    printf("Frames/second: %.1f\n",
+           elapsed_cycles / (double)GB_BENCH_FRAME_CYCLES / wall);
+    printf("Speed:         x%.2f real time\n", emulated / wall);
+
+    gb->frontend.destroy(gb);
+    gb_cart_unload(gb);
+
+    free(gb);
+
+    return 0;
+}
@@ -125,6 +125,9 @@ void gb_cart_load(struct gb *gb, const char *rom_path) {
   cart->has_rtc = false;
   has_battery_backup = false;
 
+  /* Used to write the RAM to the save file a while after it's modified */
+  gb_sync_register(gb, GB_SYNC_CART, gb_cart_sync);
+
   if (f == NULL) {
     perror("Can't open ROM file");
     goto error;
@@ -478,7 +481,8 @@ void gb_cart_sync(struct gb *gb) {
   gb_sync_next(gb, GB_SYNC_CART, GB_SYNC_NEVER);
 }
 
-uint8_t gb_cart_rom_readb(struct gb *gb, uint16_t addr) {
+/* Return the offset in the ROM image of the byte currently mapped at `addr` */
+unsigned gb_cart_rom_offset(struct gb *gb, uint16_t addr) {
   struct gb_cart *cart = &gb->cart;
   unsigned rom_off = addr;
 
@@ -531,7 +535,13 @@ uint8_t gb_cart_rom_readb(struct gb *gb, uint16_t addr) {
     die();
   }
 
-  return cart->rom[rom_off];
+  return rom_off;
+}
+
+uint8_t gb_cart_rom_readb(struct gb *gb, uint16_t addr) {
+  struct gb_cart *cart = &gb->cart;
+
+  return cart->rom[gb_cart_rom_offset(gb, addr)];
 }
 
 void gb_cart_rom_writeb(struct gb *gb, uint16_t addr, uint8_t v) {
@@ -611,6 +621,13 @@ void gb_cart_rom_writeb(struct gb *gb, uint16_t addr, uint8_t v) {
     /* Should not be reached */
     die();
   }
+
+  /* The banks mapped in the CPU address space may have changed */
+  gb_memory_map_rom(gb);
+  if (addr >= 0x4000) {
+    /* RAM bank or banking mode */
+    gb_memory_map_cram(gb);
+  }
 }
 
 unsigned gb_cart_mbc1_ram_off(struct gb *gb, uint16_t addr) {
@@ -635,64 +652,64 @@ unsigned gb_cart_mbc1_ram_off(struct gb *gb, uint16_t addr) {
   return bank * GB_RAM_BANK_SIZE + addr;
 }
 
-uint8_t gb_cart_ram_readb(struct gb *gb, uint16_t addr) {
+/* Return the offset in the cartridge RAM of the byte currently mapped at
+ * `addr`, or -1 if there's no RAM mapped there (no RAM, RTC registers...) */
+int gb_cart_ram_offset(struct gb *gb, uint16_t addr) {
   struct gb_cart *cart = &gb->cart;
-  unsigned ram_off;
 
   switch (cart->model) {
   case GB_CART_SIMPLE:
     /* No RAM */
-    return 0xff;
+    return -1;
   case GB_CART_MBC1:
     if (cart->ram_banks == 0) {
       /* No RAM */
-      return 0xff;
+      return -1;
     }
 
-    ram_off = gb_cart_mbc1_ram_off(gb, addr);
-    break;
+    return gb_cart_mbc1_ram_off(gb, addr);
   case GB_CART_MBC2:
-    ram_off = addr % 512;
-    break;
+    return addr % 512;
   case GB_CART_MBC3:
-    if (cart->cur_ram_bank <= 3) {
-      /* RAM access */
-      unsigned b;
-
-      if (cart->ram_banks == 0) {
-        /* No RAM */
-        return 0xff;
-      }
+    if (cart->cur_ram_bank <= 3 && cart->ram_banks > 0) {
+      unsigned b = cart->cur_ram_bank % cart->ram_banks;
 
-      b = cart->cur_ram_bank % cart->ram_banks;
-
-      ram_off = b * GB_RAM_BANK_SIZE + addr;
-    } else {
-      /* RTC access. Only accessible when the RAM is not write
-       * protected (even for reads) */
-      if (cart->has_rtc && !cart->ram_write_protected) {
-        return gb_rtc_read(gb, cart->cur_ram_bank);
-      } else {
-        return 0xff;
-      }
+      return b * GB_RAM_BANK_SIZE + addr;
     }
 
-    break;
+    /* No RAM or RTC access */
+    return -1;
   case GB_CART_MBC5:
     if (cart->ram_banks == 0) {
       /* No RAM */
-      return 0xff;
+      return -1;
     }
 
-    ram_off = cart->cur_ram_bank * GB_RAM_BANK_SIZE + addr;
-    break;
+    return cart->cur_ram_bank * GB_RAM_BANK_SIZE + addr;
   default:
     /* Should not be reached */
     die();
-    return 0xff;
+    return -1;
+  }
+}
+
+uint8_t gb_cart_ram_readb(struct gb *gb, uint16_t addr) {
+  struct gb_cart *cart = &gb->cart;
+  int ram_off = gb_cart_ram_offset(gb, addr);
+
+  if (ram_off >= 0) {
+    return cart->ram[ram_off];
+  }
+
+  if (cart->model == GB_CART_MBC3 && cart->cur_ram_bank > 3) {
+    /* RTC access. Only accessible when the RAM is not write
+     * protected (even for reads) */
+    if (cart->has_rtc && !cart->ram_write_protected) {
+      return gb_rtc_read(gb, cart->cur_ram_bank);
+    }
   }
 
-  return cart->ram[ram_off];
+  return 0xff;
 }
 
 void gb_cart_ram_writeb(struct gb *gb, uint16_t addr, uint8_t v) {
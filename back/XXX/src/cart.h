@@ -53,8 +53,10 @@ struct gb_cart {
 void gb_cart_load(struct gb *gb, const char *rom_path);
 void gb_cart_unload(struct gb *gb);
 void gb_cart_sync(struct gb *gb);
+unsigned gb_cart_rom_offset(struct gb *gb, uint16_t addr);
 uint8_t gb_cart_rom_readb(struct gb *gb, uint16_t addr);
 void gb_cart_rom_writeb(struct gb *gb, uint16_t addr, uint8_t v);
+int gb_cart_ram_offset(struct gb *gb, uint16_t addr);
 uint8_t gb_cart_ram_readb(struct gb *gb, uint16_t addr);
 void gb_cart_ram_writeb(struct gb *gb, uint16_t addr, uint8_t v);
 
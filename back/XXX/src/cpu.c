@@ -25,6 +25,27 @@ void cpu_printf(CPU *cpu) {
   printf("pc 0x%04X\n", cpu->pc);
 }
 
+/* Set flags to a known value rather than from the operands of an
+ * instruction */
+static inline void CPUSetFlagZ(CPU *cpu, bool z) { cpu->flag_zr = !z; }
+
+static inline void CPUSetFlagH(CPU *cpu, bool h) {
+  cpu->flag_ha = h << 4;
+  cpu->flag_hb = 0;
+  cpu->flag_hr = 0;
+}
+
+static inline void CPUSetFlagC(CPU *cpu, bool c) { cpu->flag_cr = c << 8; }
+
+/* H is evaluated from the operands and result of an addition or
+ * substraction */
+static inline void CPUSetFlagHFrom(CPU *cpu, uint8_t a, uint8_t b,
+                                   uint8_t r) {
+  cpu->flag_ha = a;
+  cpu->flag_hb = b;
+  cpu->flag_hr = r;
+}
+
 void RegisterReset(CPU *cpu) {
   cpu->af = 0x0000;
   cpu->bc = 0x0000;
@@ -32,25 +53,25 @@ void RegisterReset(CPU *cpu) {
   cpu->hl = 0x0000;
   cpu->sp = 0xfffe;
 
-  cpu->f_z = false;
-  cpu->f_n = false;
-  cpu->f_h = false;
-  cpu->f_c = false;
+  CPUSetFlagZ(cpu, false);
+  cpu->flag_n = false;
+  CPUSetFlagH(cpu, false);
+  CPUSetFlagC(cpu, false);
 }
 
 uint8_t RegisterINC(CPU *cpu, uint8_t value) {
   uint8_t r = (value + 1) & 0xff;
-  cpu->f_z = (r == 0);
-  cpu->f_n = false;
-  cpu->f_h = ((value & 0xf) == 0xf);
+  cpu->flag_zr = r;
+  cpu->flag_n = false;
+  CPUSetFlagHFrom(cpu, value, 1, r);
   return r;
 }
 
 uint8_t RegisterDEC(CPU *cpu, uint8_t value) {
   uint8_t r = (value - 1) & 0xff;
-  cpu->f_z = (r == 0);
-  cpu->f_n = true;
-  cpu->f_h = ((value & 0xf) == 0);
+  cpu->flag_zr = r;
+  cpu->flag_n = true;
+  CPUSetFlagHFrom(cpu, value, 1, r);
   return r;
 }
 
@@ -59,9 +80,10 @@ uint16_t RegisterAdd16(CPU *cpu, uint16_t a, uint16_t b) {
   uint32_t wb = b;
   uint32_t r = a + b;
 
-  cpu->f_n = false;
-  cpu->f_c = r & 0x10000;
-  cpu->f_h = (wa ^ wb ^ r) & 0x1000;
+  /* Carry and Half-carry are for the high byte */
+  cpu->flag_n = false;
+  cpu->flag_cr = r >> 8;
+  CPUSetFlagHFrom(cpu, wa >> 8, wb >> 8, r >> 8);
   return r;
 }
 
@@ -75,10 +97,10 @@ void RegisterRLCA(CPU *cpu) {
 
   cpu->a = a;
 
-  cpu->f_z = false;
-  cpu->f_n = false;
-  cpu->f_h = false;
-  cpu->f_c = c;
+  CPUSetFlagZ(cpu, false);
+  cpu->flag_n = false;
+  CPUSetFlagH(cpu, false);
+  CPUSetFlagC(cpu, c);
 }
 
 void RegisterHLAdd16(CPU *cpu, uint16_t value) {
@@ -86,9 +108,10 @@ void RegisterHLAdd16(CPU *cpu, uint16_t value) {
   uint32_t wb = (uint32_t)value;
   uint32_t r = wa + wb;
 
-  cpu->f_n = false;
-  cpu->f_c = r & 0x10000;
-  cpu->f_h = (wa ^ wb ^ r) & 0x1000;
+  /* Carry and Half-carry are for the high byte */
+  cpu->flag_n = false;
+  cpu->flag_cr = r >> 8;
+  CPUSetFlagHFrom(cpu, wa >> 8, wb >> 8, r >> 8);
   cpu->hl = (uint16_t)r;
 }
 
@@ -115,6 +138,16 @@ void gb_cpu_reset(struct gb *gb) {
 
   RegisterReset(cpu);
 
+  cpu->block_cache_enable = true;
+  cpu->idle_skip_enable = true;
+  cpu->operands = NULL;
+  cpu->block_exit = false;
+  cpu->ram_generation = 0;
+  memset(cpu->ram_code_pages, 0, sizeof(cpu->ram_code_pages));
+  for (size_t i = 0; i < GB_CPU_BLOCK_CACHE_SIZE; i++) {
+    cpu->blocks[i].n_insns = 0;
+  }
+
   /* XXX For the time being we don't emulate the BOOTROM so we start the
    * execution just past it */
   cpu->pc = 0x100;
@@ -149,24 +182,77 @@ static const uint16_t gb_irq_handlers[5] = {[GB_IRQ_VSYNC] = 0x0040,
                                             [GB_IRQ_SERIAL] = 0x0058,
                                             [GB_IRQ_INPUT] = 0x0060};
 
+#ifdef GB_CPU_EAGER_SYNC
+
+/* Process the events as soon as they're due, after every memory access */
+#define gb_cpu_instruction_tick gb_cpu_clock_tick
+
+static inline void gb_cpu_sync_events(struct gb *) {}
+
+static inline bool gb_cpu_access_is_private(uint16_t) { return true; }
+
+#else
+
+/* Advance the clock without processing the events which become due. They run
+ * at the end of the instruction or before the next access which could observe
+ * them, whichever comes first. Events only change the I/O registers, VRAM, OAM
+ * and the IRQ flags and only read memory, so the value returned by any other
+ * read doesn't depend on when they run. */
+static inline void gb_cpu_instruction_tick(struct gb *gb, int32_t cycles) {
+  gb->timestamp += cycles >> gb->double_speed;
+}
+
+/* Run the events which became due since the last check */
+static inline void gb_cpu_sync_events(struct gb *gb) {
+  if (gb->timestamp >= gb->sync.first_event) {
+    gb_sync_check_events(gb);
+  }
+}
+
+/* Returns true if reading `addr` gives the same result whether the pending
+ * events have been processed or not: ROM, cartridge RAM, internal RAM and
+ * zero page RAM. */
+static inline bool gb_cpu_access_is_private(uint16_t addr) {
+  return addr < 0x8000 || (addr >= 0xa000 && addr < 0xfe00) || addr >= 0xff80;
+}
+
+#endif
+
 // Update
 void CPUTick(CPU *cpu, unsigned int tick) {
-  gb_cpu_clock_tick(cpu->memory, tick);
+  gb_cpu_instruction_tick(cpu->memory, tick);
 }
 
 uint8_t MemoryRead(Memory *memory, uint16_t address) {
-  uint8_t b = gb_memory_readb(memory, address);
-  gb_cpu_clock_tick(memory, 4);
+  uint8_t b;
+
+  if (!gb_cpu_access_is_private(address)) {
+    gb_cpu_sync_events(memory);
+  }
+
+  b = gb_memory_readb(memory, address);
+  gb_cpu_instruction_tick(memory, 4);
   return b;
 }
 
 void MemoryWrite(Memory *memory, uint16_t address, uint8_t value) {
+  /* Events read memory (DMA, line rendering...) so they must see the value
+   * from before the write if they were due earlier */
+  gb_cpu_sync_events(memory);
+
   gb_memory_writeb(memory, address, value);
-  gb_cpu_clock_tick(memory, 4);
+  gb_cpu_instruction_tick(memory, 4);
 }
 
 uint8_t CPUReadNextI8(CPU *cpu) {
-  uint8_t i8 = MemoryRead(cpu->memory, cpu->pc);
+  uint8_t i8;
+  if (cpu->operands) {
+    /* Running from the block cache, the operand has already been fetched */
+    i8 = *cpu->operands++;
+    CPUTick(cpu, 4);
+  } else {
+    i8 = MemoryRead(cpu->memory, cpu->pc);
+  }
   cpu->pc = (cpu->pc + 1) & 0xffff;
   return i8;
 }
@@ -195,94 +281,95 @@ static CPUInstruction cpuInstructions[0x100];
 
 void NOP(CPU *) {}
 
-static size_t opcode = 0x00;
-
-uint16_t *DecodeR16(CPU *cpu) {
-  switch (opcode & 0b00110000) {
-  case 0b00000000:
-    return &cpu->bc;
-  case 0b00010000:
-    return &cpu->de;
-  case 0b00100000:
-    return &cpu->hl;
-  default: // 0b00110000
-    return &cpu->sp;
+/* Most opcodes encode their register operands in a few bit fields. Rather
+ * than decoding these fields every time an instruction is executed, a
+ * specialized handler is generated for every possible operand and put in the
+ * right slot of the dispatch tables by gb_cpu_init. */
+
+/* Calls X(NAME, reg) for each 8-bit register, in the order of the r8 operand
+ * encoding. [HL] (encoding 6) is always handled separately. */
+#define GB_CPU_FOR_EACH_R8(X)                                                  \
+  X(B, b) X(C, c) X(D, d) X(E, e) X(H, h) X(L, l) X(A, a)
+
+/* Handlers for the 8 possible r8 operands, in encoding order */
+#define GB_CPU_R8_HANDLERS(prefix)                                             \
+  {                                                                            \
+    prefix##_B, prefix##_C, prefix##_D, prefix##_E, prefix##_H, prefix##_L,    \
+        prefix##_MHL, prefix##_A                                               \
   }
-}
 
-uint16_t *DecodeR16Mem(CPU *cpu) {
-  static uint16_t r16mem;
-  switch (opcode & 0b00110000) {
-  case 0b00000000:
-    return &cpu->bc;
-  case 0b00010000:
-    return &cpu->de;
-  case 0b00100000:
-    r16mem = cpu->hl;
-    cpu->hl++;
-    return &r16mem;
-  default: // 0b00110000
-    r16mem = cpu->hl;
-    cpu->hl--;
-    return &r16mem;
+/* Handlers for the 4 possible r16 operands, in encoding order */
+#define GB_CPU_R16_HANDLERS(prefix)                                            \
+  { prefix##_BC, prefix##_DE, prefix##_HL, prefix##_SP }
+
+/* LD r16, imm16 / INC r16 / DEC r16 / ADD HL, r16 */
+#define GB_CPU_R16_OPS(NAME, reg)                                              \
+  static void LD_##NAME##_IMM16(CPU *cpu) { cpu->reg = CPUReadNextI16(cpu); } \
+                                                                               \
+  static void INC_##NAME(CPU *cpu) {                                           \
+    cpu->reg = (cpu->reg + 1) & 0xffff;                                        \
+    CPUTick(cpu, 4);                                                           \
+  }                                                                            \
+                                                                               \
+  static void DEC_##NAME(CPU *cpu) {                                           \
+    cpu->reg = (cpu->reg - 1) & 0xffff;                                        \
+    CPUTick(cpu, 4);                                                           \
+  }                                                                            \
+                                                                               \
+  static void ADD_HL_##NAME(CPU *cpu) {                                        \
+    RegisterHLAdd16(cpu, cpu->reg);                                            \
+    CPUTick(cpu, 4);                                                           \
   }
-}
 
-uint8_t *DecodeR8(CPU *cpu) {
-  switch (opcode & 0b00111000) {
-  case 0b00000000:
-    return &cpu->b;
-  case 0b00001000:
-    return &cpu->c;
-  case 0b00010000:
-    return &cpu->d;
-  case 0b00011000:
-    return &cpu->e;
-  case 0b00100000:
-    return &cpu->h;
-  case 0b00101000:
-    return &cpu->l;
-  case 0b00110000:
-    return NULL; // Update late [HL]
-  default:       // 0b00111000:
-    return &cpu->a;
+GB_CPU_R16_OPS(BC, bc)
+GB_CPU_R16_OPS(DE, de)
+GB_CPU_R16_OPS(HL, hl)
+GB_CPU_R16_OPS(SP, sp)
+
+/* LD [r16mem], A / LD A, [r16mem]. `inc` is applied to HL after the access
+ * for the [HL+] and [HL-] forms. */
+#define GB_CPU_R16MEM_OPS(NAME, reg, inc)                                      \
+  static void LD_M##NAME##_A(CPU *cpu) {                                       \
+    uint16_t addr = cpu->reg;                                                  \
+    cpu->reg += inc;                                                           \
+    CPUMemoryWriteI8(cpu, addr, cpu->a);                                       \
+  }                                                                            \
+                                                                               \
+  static void LD_A_M##NAME(CPU *cpu) {                                         \
+    uint16_t addr = cpu->reg;                                                  \
+    cpu->reg += inc;                                                           \
+    cpu->a = MemoryRead(cpu->memory, addr);                                    \
   }
-}
 
-uint8_t *DecodeR8Source(CPU *cpu) {
-  switch (opcode & 0b00000111) {
-  case 0b00000000:
-    return &cpu->b;
-  case 0b00000001:
-    return &cpu->c;
-  case 0b00000010:
-    return &cpu->d;
-  case 0b00000011:
-    return &cpu->e;
-  case 0b00000100:
-    return &cpu->h;
-  case 0b00000101:
-    return &cpu->l;
-  case 0b00000110:
-    return NULL; // Update late [HL]
-  default:       // 0b00000111:
-    return &cpu->a;
-  }
-}
+GB_CPU_R16MEM_OPS(BC, bc, 0)
+GB_CPU_R16MEM_OPS(DE, de, 0)
+GB_CPU_R16MEM_OPS(HLI, hl, 1)
+GB_CPU_R16MEM_OPS(HLD, hl, -1)
+
+/* INC r8 / DEC r8 / LD r8, imm8 */
+#define GB_CPU_R8_OPS(NAME, reg)                                               \
+  static void INC_##NAME(CPU *cpu) { cpu->reg = RegisterINC(cpu, cpu->reg); }  \
+                                                                               \
+  static void DEC_##NAME(CPU *cpu) { cpu->reg = RegisterDEC(cpu, cpu->reg); }  \
+                                                                               \
+  static void LD_##NAME##_IMM8(CPU *cpu) { cpu->reg = CPUReadNextI8(cpu); }
+
+GB_CPU_FOR_EACH_R8(GB_CPU_R8_OPS)
 
-void LD_R16_IMM16(CPU *cpu) {
-  uint16_t *r16 = DecodeR16(cpu);
-  *r16 = CPUReadNextI16(cpu);
+static void INC_MHL(CPU *cpu) {
+  uint8_t value = MemoryRead(cpu->memory, cpu->hl);
+  value = RegisterINC(cpu, value);
+  MemoryWrite(cpu->memory, cpu->hl, value);
 }
 
-void LD_MR16MEM_A(CPU *cpu) {
-  uint16_t *r16mem = DecodeR16Mem(cpu);
-  CPUMemoryWriteI8(cpu, *r16mem, cpu->a);
+static void DEC_MHL(CPU *cpu) {
+  uint8_t value = MemoryRead(cpu->memory, cpu->hl);
+  value = RegisterDEC(cpu, value);
+  MemoryWrite(cpu->memory, cpu->hl, value);
 }
 
-void LD_A_MR16MEM(CPU *cpu) {
-  uint16_t *r16mem = DecodeR16Mem(cpu);
-  cpu->a = MemoryRead(cpu->memory, *r16mem);
+static void LD_MHL_IMM8(CPU *cpu) {
+  MemoryWrite(cpu->memory, cpu->hl, CPUReadNextI8(cpu));
 }
 
 void LD_MIMM16_SP(CPU *cpu) {
@@ -290,61 +377,6 @@ void LD_MIMM16_SP(CPU *cpu) {
   CPUMemoryWriteI16(cpu, imm16, cpu->sp);
 }
 
-void INC_R16(CPU *cpu) {
-  uint16_t *r16 = DecodeR16(cpu);
-  uint16_t value = *r16;
-  value = (value + 1) & 0xffff;
-  *r16 = value;
-  CPUTick(cpu, 4);
-}
-
-void DEC_R16(CPU *cpu) {
-  uint16_t *r16 = DecodeR16(cpu);
-  uint16_t value = *r16;
-  value = (value - 1) & 0xffff;
-  *r16 = value;
-  CPUTick(cpu, 4);
-}
-
-void ADD_HL_R16(CPU *cpu) {
-  uint16_t *r16 = DecodeR16(cpu);
-  RegisterHLAdd16(cpu, *r16);
-  CPUTick(cpu, 4);
-}
-
-void INC_R8(CPU *cpu) {
-  if (((opcode >> 3) & 0b00000111) == 0b00000110) {
-    uint8_t value = MemoryRead(cpu->memory, cpu->hl);
-    value = RegisterINC(cpu, value);
-    MemoryWrite(cpu->memory, cpu->hl, value);
-  } else {
-    uint8_t *r8 = DecodeR8(cpu);
-    uint8_t value = RegisterINC(cpu, *r8);
-    *r8 = value;
-  }
-}
-
-void DEC_R8(CPU *cpu) {
-  if (((opcode >> 3) & 0b00000111) == 0b00000110) {
-    uint8_t value = MemoryRead(cpu->memory, cpu->hl);
-    value = RegisterDEC(cpu, value);
-    MemoryWrite(cpu->memory, cpu->hl, value);
-  } else {
-    uint8_t *r8 = DecodeR8(cpu);
-    uint8_t value = RegisterDEC(cpu, *r8);
-    *r8 = value;
-  }
-}
-
-void LD_R8_IMM8(CPU *cpu) {
-  if (((opcode >> 3) & 0b00000111) == 0b00000110) {
-    MemoryWrite(cpu->memory, cpu->hl, CPUReadNextI8(cpu));
-  } else {
-    uint8_t *r8 = DecodeR8(cpu);
-    *r8 = CPUReadNextI8(cpu);
-  }
-}
-
 void CPURLCA(CPU *cpu) {
   uint8_t a = cpu->a;
   uint8_t c;
@@ -354,10 +386,10 @@ void CPURLCA(CPU *cpu) {
   a |= c;
 
   cpu->a = a;
-  cpu->f_z = false;
-  cpu->f_n = false;
-  cpu->f_h = false;
-  cpu->f_c = c;
+  CPUSetFlagZ(cpu, false);
+  cpu->flag_n = false;
+  CPUSetFlagH(cpu, false);
+  CPUSetFlagC(cpu, c);
 }
 
 void CPURRCA(CPU *cpu) {
@@ -369,15 +401,15 @@ void CPURRCA(CPU *cpu) {
   a |= (c << 7);
 
   cpu->a = a;
-  cpu->f_z = false;
-  cpu->f_n = false;
-  cpu->f_h = false;
-  cpu->f_c = c;
+  CPUSetFlagZ(cpu, false);
+  cpu->flag_n = false;
+  CPUSetFlagH(cpu, false);
+  CPUSetFlagC(cpu, c);
 }
 
 void CPURLA(CPU *cpu) {
   uint8_t a = cpu->a;
-  uint8_t c = cpu->f_c;
+  uint8_t c = gb_cpu_flag_c(cpu);
   uint8_t new_c;
 
   /* Current carry goes to LSB of A, MSB of A becomes new carry */
@@ -386,15 +418,15 @@ void CPURLA(CPU *cpu) {
   a |= c;
 
   cpu->a = a;
-  cpu->f_z = false;
-  cpu->f_n = false;
-  cpu->f_h = false;
-  cpu->f_c = new_c;
+  CPUSetFlagZ(cpu, false);
+  cpu->flag_n = false;
+  CPUSetFlagH(cpu, false);
+  CPUSetFlagC(cpu, new_c);
 }
 
 void CPURRA(CPU *cpu) {
   uint8_t a = cpu->a;
-  uint8_t c = cpu->f_c;
+  uint8_t c = gb_cpu_flag_c(cpu);
   uint8_t new_c;
 
   /* Current carry goes to MSB of A, LSB of A becomes new carry */
@@ -403,10 +435,10 @@ void CPURRA(CPU *cpu) {
   a |= (c << 7);
 
   cpu->a = a;
-  cpu->f_z = false;
-  cpu->f_n = false;
-  cpu->f_h = false;
-  cpu->f_c = new_c;
+  CPUSetFlagZ(cpu, false);
+  cpu->flag_n = false;
+  CPUSetFlagH(cpu, false);
+  CPUSetFlagC(cpu, new_c);
 }
 
 void CPUDAA(CPU *cpu) {
@@ -414,18 +446,18 @@ void CPUDAA(CPU *cpu) {
   uint8_t adj = 0;
 
   /* See if we had a carry/borrow for the low nibble in the last operation */
-  if (cpu->f_h) {
+  if (gb_cpu_flag_h(cpu)) {
     /* Yes, we have to adjust it. */
     adj |= 0x06;
   }
 
   /* See if we had a carry/borrow for the high nibble in the last operation */
-  if (cpu->f_c) {
+  if (gb_cpu_flag_c(cpu)) {
     // Yes, we have to adjust it.
     adj |= 0x60;
   }
 
-  if (cpu->f_n) {
+  if (cpu->flag_n) {
     /* If the operation was a substraction we're done since we can never
      * end up in the A-F range by substracting without generating a
      * (half)carry. */
@@ -446,28 +478,28 @@ void CPUDAA(CPU *cpu) {
   };
 
   cpu->a = a;
-  cpu->f_z = (a == 0);
-  cpu->f_c = ((adj & 0x60) != 0);
-  cpu->f_h = false;
+  cpu->flag_zr = a;
+  CPUSetFlagC(cpu, adj & 0x60);
+  CPUSetFlagH(cpu, false);
 }
 
 void CPUCPL(CPU *cpu) {
   /* Complement A */
   cpu->a = ~cpu->a;
-  cpu->f_n = true;
-  cpu->f_h = true;
+  cpu->flag_n = true;
+  CPUSetFlagH(cpu, true);
 }
 
 void CPUSCF(CPU *cpu) {
-  cpu->f_n = false;
-  cpu->f_h = false;
-  cpu->f_c = true;
+  cpu->flag_n = false;
+  CPUSetFlagH(cpu, false);
+  CPUSetFlagC(cpu, true);
 }
 
 void CPUCCF(CPU *cpu) {
-  cpu->f_n = false;
-  cpu->f_h = false;
-  cpu->f_c = !cpu->f_c;
+  cpu->flag_n = false;
+  CPUSetFlagH(cpu, false);
+  cpu->flag_cr ^= 0x100;
 }
 
 void CPU_JR_IMM8(CPU *cpu) {
@@ -477,26 +509,31 @@ void CPU_JR_IMM8(CPU *cpu) {
   CPU_LOAD_PC(cpu, pc);
 }
 
-bool DecodeCond(CPU *cpu) {
-  switch (opcode & 0b00011000) {
-  case 0b00000000:
-    return !cpu->f_z;
-  case 0b00001000:
-    return cpu->f_z;
-  case 0b00010000:
-    return !cpu->f_c;
-  default: // 0b00011000:
-    return cpu->f_c;
+/* Branch conditions, in the order of the cond operand encoding */
+#define GB_CPU_COND_NZ (!gb_cpu_flag_z(cpu))
+#define GB_CPU_COND_Z (gb_cpu_flag_z(cpu))
+#define GB_CPU_COND_NC (!gb_cpu_flag_c(cpu))
+#define GB_CPU_COND_C (gb_cpu_flag_c(cpu))
+
+#define GB_CPU_COND_HANDLERS(prefix, suffix)                                   \
+  {                                                                            \
+    prefix##_NZ##suffix, prefix##_Z##suffix, prefix##_NC##suffix,              \
+        prefix##_C##suffix                                                     \
   }
-}
 
-void CPU_JR_COND_IMM8(CPU *cpu) {
-  if (DecodeCond(cpu)) {
-    CPU_JR_IMM8(cpu);
-  } else {
-    CPUReadNextI8(cpu);
+#define GB_CPU_JR_COND(CC)                                                     \
+  static void CPU_JR_##CC##_IMM8(CPU *cpu) {                                   \
+    if (GB_CPU_COND_##CC) {                                                    \
+      CPU_JR_IMM8(cpu);                                                        \
+    } else {                                                                   \
+      CPUReadNextI8(cpu);                                                      \
+    }                                                                          \
   }
-}
+
+GB_CPU_JR_COND(NZ)
+GB_CPU_JR_COND(Z)
+GB_CPU_JR_COND(NC)
+GB_CPU_JR_COND(C)
 
 void CPU_STOP(CPU *cpu) {
   struct gb *gb = cpu->memory;
@@ -508,6 +545,7 @@ void CPU_STOP(CPU *cpu) {
 
     /* Clock speed is going to change, synchronize the relevant devices
      * with the current clock speed */
+    gb_cpu_sync_events(gb);
     gb_timer_sync(gb);
     gb_dma_sync(gb);
 
@@ -525,22 +563,31 @@ void CPU_STOP(CPU *cpu) {
   die();
 }
 
-void CPU_LD_R8_R8(CPU *cpu) {
-  uint8_t value;
-  if ((opcode & 0b00000111) == 0b00000110) {
-    value = MemoryRead(cpu->memory, cpu->hl);
-  } else {
-    uint8_t *src = DecodeR8Source(cpu);
-    value = *src;
-  }
+/* LD r8, r8. The destination is the first operand. */
+#define GB_CPU_LD_R8_R8(DST, dst, SRC, src)                                    \
+  static void CPU_LD_##DST##_##SRC(CPU *cpu) { cpu->dst = cpu->src; }
 
-  if (((opcode >> 3) & 0b00000111) == 0b00000110) {
-    MemoryWrite(cpu->memory, cpu->hl, value);
-  } else {
-    uint8_t *dst = DecodeR8(cpu);
-    *dst = value;
+/* LD r8, [HL] and LD [HL], r8 */
+#define GB_CPU_LD_MHL(NAME, reg)                                               \
+  static void CPU_LD_##NAME##_MHL(CPU *cpu) {                                  \
+    cpu->reg = MemoryRead(cpu->memory, cpu->hl);                               \
+  }                                                                            \
+                                                                               \
+  static void CPU_LD_MHL_##NAME(CPU *cpu) {                                    \
+    MemoryWrite(cpu->memory, cpu->hl, cpu->reg);                               \
   }
-}
+
+#define GB_CPU_LD_R8_ALL(DST, dst)                                             \
+  GB_CPU_LD_R8_R8(DST, dst, B, b)                                              \
+  GB_CPU_LD_R8_R8(DST, dst, C, c)                                              \
+  GB_CPU_LD_R8_R8(DST, dst, D, d)                                              \
+  GB_CPU_LD_R8_R8(DST, dst, E, e)                                              \
+  GB_CPU_LD_R8_R8(DST, dst, H, h)                                              \
+  GB_CPU_LD_R8_R8(DST, dst, L, l)                                              \
+  GB_CPU_LD_R8_R8(DST, dst, A, a)                                              \
+  GB_CPU_LD_MHL(DST, dst)
+
+GB_CPU_FOR_EACH_R8(GB_CPU_LD_R8_ALL)
 
 void CPU_HALT(CPU *cpu) { cpu->halted = true; }
 
@@ -551,52 +598,30 @@ uint8_t CPU_ADD_SET_FLAGS(CPU *cpu, uint8_t a, uint8_t b) {
 
   uint16_t r = al + bl;
 
-  cpu->f_z = !(r & 0xff);
-  cpu->f_n = false;
-  cpu->f_h = (a ^ b ^ r) & 0x10;
-  cpu->f_c = r & 0x100;
+  cpu->flag_zr = r;
+  cpu->flag_n = false;
+  CPUSetFlagHFrom(cpu, a, b, r);
+  cpu->flag_cr = r;
 
   return r;
 }
 
-void CPU_ADD_A_R8(CPU *cpu) {
-  uint8_t value;
-  uint8_t *r8 = DecodeR8Source(cpu);
-  if (r8) {
-    value = *r8;
-  } else {
-    value = MemoryRead(cpu->memory, cpu->hl);
-  }
-  cpu->a = CPU_ADD_SET_FLAGS(cpu, cpu->a, value);
-}
-
 uint8_t CPU_ADC_SET_FLAGS(CPU *cpu, uint8_t a, uint8_t b) {
   /* Check for carry using 16bit arithmetic */
   uint16_t al = a;
   uint16_t bl = b;
-  uint16_t c = cpu->f_c;
+  uint16_t c = gb_cpu_flag_c(cpu);
 
   uint16_t r = al + bl + c;
 
-  cpu->f_z = !(r & 0xff);
-  cpu->f_n = false;
-  cpu->f_h = (a ^ b ^ r) & 0x10;
-  cpu->f_c = r & 0x100;
+  cpu->flag_zr = r;
+  cpu->flag_n = false;
+  CPUSetFlagHFrom(cpu, a, b, r);
+  cpu->flag_cr = r;
 
   return r;
 }
 
-void CPU_ADC_A_R8(CPU *cpu) {
-  uint8_t value;
-  uint8_t *r8 = DecodeR8Source(cpu);
-  if (r8) {
-    value = *r8;
-  } else {
-    value = MemoryRead(cpu->memory, cpu->hl);
-  }
-  cpu->a = CPU_ADC_SET_FLAGS(cpu, cpu->a, value);
-}
-
 uint8_t CPU_SUB_SET_FLAGS(CPU *cpu, uint8_t a, uint8_t b) {
   /* Check for carry using 16bit arithmetic */
   uint16_t al = a;
@@ -604,126 +629,103 @@ uint8_t CPU_SUB_SET_FLAGS(CPU *cpu, uint8_t a, uint8_t b) {
 
   uint16_t r = al - bl;
 
-  cpu->f_z = !(r & 0xff);
-  cpu->f_n = true;
-  cpu->f_h = (a ^ b ^ r) & 0x10;
-  cpu->f_c = r & 0x100;
+  cpu->flag_zr = r;
+  cpu->flag_n = true;
+  CPUSetFlagHFrom(cpu, a, b, r);
+  cpu->flag_cr = r;
 
   return r;
 }
 
-void CPU_SUB_A_R8(CPU *cpu) {
-  uint8_t value;
-  uint8_t *r8 = DecodeR8Source(cpu);
-  if (r8) {
-    value = *r8;
-  } else {
-    value = MemoryRead(cpu->memory, cpu->hl);
-  }
-  cpu->a = CPU_SUB_SET_FLAGS(cpu, cpu->a, value);
-}
-
 uint8_t CPU_SBC_SET_FLAGS(CPU *cpu, uint8_t a, uint8_t b) {
   /* Check for carry using 16bit arithmetic */
   uint16_t al = a;
   uint16_t bl = b;
-  uint16_t c = cpu->f_c;
+  uint16_t c = gb_cpu_flag_c(cpu);
 
   uint16_t r = al - bl - c;
 
-  cpu->f_z = !(r & 0xff);
-  cpu->f_n = true;
-  cpu->f_h = (a ^ b ^ r) & 0x10;
-  cpu->f_c = r & 0x100;
+  cpu->flag_zr = r;
+  cpu->flag_n = true;
+  CPUSetFlagHFrom(cpu, a, b, r);
+  cpu->flag_cr = r;
 
   return r;
 }
 
-void CPU_SBC_A_R8(CPU *cpu) {
-  uint8_t value;
-  uint8_t *r8 = DecodeR8Source(cpu);
-  if (r8) {
-    value = *r8;
-  } else {
-    value = MemoryRead(cpu->memory, cpu->hl);
-  }
-  cpu->a = CPU_SBC_SET_FLAGS(cpu, cpu->a, value);
-}
-
 uint8_t CPU_AND_SET_FLAGS(CPU *cpu, uint8_t a, uint8_t b) {
   uint8_t r = a & b;
 
-  cpu->f_z = (r == 0);
-  cpu->f_n = false;
-  cpu->f_h = true;
-  cpu->f_c = false;
+  cpu->flag_zr = r;
+  cpu->flag_n = false;
+  CPUSetFlagH(cpu, true);
+  CPUSetFlagC(cpu, false);
 
   return r;
 }
 
-void CPU_AND_A_R8(CPU *cpu) {
-  uint8_t value;
-  uint8_t *r8 = DecodeR8Source(cpu);
-  if (r8) {
-    value = *r8;
-  } else {
-    value = MemoryRead(cpu->memory, cpu->hl);
-  }
-  cpu->a = CPU_AND_SET_FLAGS(cpu, cpu->a, value);
-}
-
 uint8_t CPU_XOR_SET_FLAGS(CPU *cpu, uint8_t a, uint8_t b) {
   uint8_t r = a ^ b;
 
-  cpu->f_z = (r == 0);
-  cpu->f_n = false;
-  cpu->f_h = false;
-  cpu->f_c = false;
+  cpu->flag_zr = r;
+  cpu->flag_n = false;
+  CPUSetFlagH(cpu, false);
+  CPUSetFlagC(cpu, false);
 
   return r;
 }
 
-void CPU_XOR_A_R8(CPU *cpu) {
-  uint8_t value;
-  uint8_t *r8 = DecodeR8Source(cpu);
-  if (r8) {
-    value = *r8;
-  } else {
-    value = MemoryRead(cpu->memory, cpu->hl);
-  }
-  cpu->a = CPU_XOR_SET_FLAGS(cpu, cpu->a, value);
-}
-
 uint8_t CPU_OR_SET_FLAGS(CPU *cpu, uint8_t a, uint8_t b) {
   uint8_t r = a | b;
 
-  cpu->f_z = (r == 0);
-  cpu->f_n = false;
-  cpu->f_h = false;
-  cpu->f_c = false;
+  cpu->flag_zr = r;
+  cpu->flag_n = false;
+  CPUSetFlagH(cpu, false);
+  CPUSetFlagC(cpu, false);
 
   return r;
 }
 
-void CPU_OR_A_R8(CPU *cpu) {
-  uint8_t value;
-  uint8_t *r8 = DecodeR8Source(cpu);
-  if (r8) {
-    value = *r8;
-  } else {
-    value = MemoryRead(cpu->memory, cpu->hl);
+/* ALU A, r8 */
+#define GB_CPU_ALU_R8(OP, NAME, reg)                                           \
+  static void CPU_##OP##_A_##NAME(CPU *cpu) {                                  \
+    cpu->a = CPU_##OP##_SET_FLAGS(cpu, cpu->a, cpu->reg);                      \
   }
-  cpu->a = CPU_OR_SET_FLAGS(cpu, cpu->a, value);
-}
 
-void CPU_CP_A_R8(CPU *cpu) {
-  uint8_t value;
-  uint8_t *r8 = DecodeR8Source(cpu);
-  if (r8) {
-    value = *r8;
-  } else {
-    value = MemoryRead(cpu->memory, cpu->hl);
+#define GB_CPU_ALU_MHL(OP)                                                     \
+  static void CPU_##OP##_A_MHL(CPU *cpu) {                                     \
+    uint8_t value = MemoryRead(cpu->memory, cpu->hl);                          \
+    cpu->a = CPU_##OP##_SET_FLAGS(cpu, cpu->a, value);                         \
+  }
+
+#define GB_CPU_ALU_ALL(OP)                                                     \
+  GB_CPU_ALU_R8(OP, B, b)                                                      \
+  GB_CPU_ALU_R8(OP, C, c)                                                      \
+  GB_CPU_ALU_R8(OP, D, d)                                                      \
+  GB_CPU_ALU_R8(OP, E, e)                                                      \
+  GB_CPU_ALU_R8(OP, H, h)                                                      \
+  GB_CPU_ALU_R8(OP, L, l)                                                      \
+  GB_CPU_ALU_R8(OP, A, a)                                                      \
+  GB_CPU_ALU_MHL(OP)
+
+GB_CPU_ALU_ALL(ADD)
+GB_CPU_ALU_ALL(ADC)
+GB_CPU_ALU_ALL(SUB)
+GB_CPU_ALU_ALL(SBC)
+GB_CPU_ALU_ALL(AND)
+GB_CPU_ALU_ALL(XOR)
+GB_CPU_ALU_ALL(OR)
+
+/* CP is a SUB which doesn't store the result */
+#define GB_CPU_CP_R8(NAME, reg)                                                \
+  static void CPU_CP_A_##NAME(CPU *cpu) {                                      \
+    CPU_SUB_SET_FLAGS(cpu, cpu->a, cpu->reg);                                  \
   }
+
+GB_CPU_FOR_EACH_R8(GB_CPU_CP_R8)
+
+static void CPU_CP_A_MHL(CPU *cpu) {
+  uint8_t value = MemoryRead(cpu->memory, cpu->hl);
   CPU_SUB_SET_FLAGS(cpu, cpu->a, value);
 }
 
@@ -784,12 +786,18 @@ void CPU_RET(CPU *cpu) {
   CPU_LOAD_PC(cpu, addr);
 }
 
-void CPU_RET_COND(CPU *cpu) {
-  if (DecodeCond(cpu)) {
-    CPU_RET(cpu);
+#define GB_CPU_RET_COND(CC)                                                    \
+  static void CPU_RET_##CC(CPU *cpu) {                                         \
+    if (GB_CPU_COND_##CC) {                                                    \
+      CPU_RET(cpu);                                                            \
+    }                                                                          \
+    CPUTick(cpu, 4);                                                           \
   }
-  CPUTick(cpu, 4);
-}
+
+GB_CPU_RET_COND(NZ)
+GB_CPU_RET_COND(Z)
+GB_CPU_RET_COND(NC)
+GB_CPU_RET_COND(C)
 
 void CPU_RETi(CPU *cpu) {
   CPU_RET(cpu);
@@ -802,13 +810,19 @@ void CPU_JP_IMM16(CPU *cpu) {
   CPU_LOAD_PC(cpu, i16);
 }
 
-void CPU_JP_COND_IMM16(CPU *cpu) {
-  if (DecodeCond(cpu)) {
-    CPU_JP_IMM16(cpu);
-  } else {
-    CPUReadNextI16(cpu);
+#define GB_CPU_JP_COND(CC)                                                     \
+  static void CPU_JP_##CC##_IMM16(CPU *cpu) {                                  \
+    if (GB_CPU_COND_##CC) {                                                    \
+      CPU_JP_IMM16(cpu);                                                       \
+    } else {                                                                   \
+      CPUReadNextI16(cpu);                                                     \
+    }                                                                          \
   }
-}
+
+GB_CPU_JP_COND(NZ)
+GB_CPU_JP_COND(Z)
+GB_CPU_JP_COND(NC)
+GB_CPU_JP_COND(C)
 
 void CPU_JP_HL(CPU *cpu) { CPU_LOAD_PC(cpu, cpu->hl); }
 
@@ -832,67 +846,62 @@ void CPU_CALL_IMM16(CPU *cpu) {
   CPU_RST(cpu, i16);
 }
 
-void CPU_CALL_COND_IMM16(CPU *cpu) {
-  if (DecodeCond(cpu)) {
-    CPU_CALL_IMM16(cpu);
-  } else {
-    CPUReadNextI16(cpu);
-  }
-}
-
-void CPU_RST_TGT3(CPU *cpu) {
-  static uint16_t address[] = {0x00, 0x08, 0x10, 0x18, 0x20, 0x28, 0x30, 0x38};
-  uint8_t index = (opcode & 0b00111000) >> 3;
-  CPU_RST(cpu, address[index]);
-}
-
-uint16_t *DecodeR16skt(CPU *cpu) {
-  switch (opcode & 0b00110000) {
-  case 0b00000000:
-    return &cpu->bc;
-    break;
-  case 0b00010000:
-    return &cpu->de;
-    break;
-  case 0b00100000:
-    return &cpu->hl;
-    break;
-  default: // 0b00110000;
-    /*return &cpu->af; */
-    return NULL;
+#define GB_CPU_CALL_COND(CC)                                                   \
+  static void CPU_CALL_##CC##_IMM16(CPU *cpu) {                                \
+    if (GB_CPU_COND_##CC) {                                                    \
+      CPU_CALL_IMM16(cpu);                                                     \
+    } else {                                                                   \
+      CPUReadNextI16(cpu);                                                     \
+    }                                                                          \
   }
-}
 
-void CPU_POP_R16stk(CPU *cpu) {
-  uint16_t *r16 = DecodeR16skt(cpu);
-  if (r16) {
-    *r16 = CPU_POPW(cpu);
-  } else {
-    cpu->f = (CPU_POPB(cpu) & 0b11110000);
-    cpu->a = CPU_POPB(cpu);
-
-    /* Restore flags from memory (low 4 bits are ignored) */
-    cpu->f_z = cpu->fz;
-    cpu->f_n = cpu->fn;
-    cpu->f_h = cpu->fh;
-    cpu->f_c = cpu->fc;
-  }
-}
-
-void CPU_PUSH_R16stk(CPU *cpu) {
-  uint16_t *r16 = DecodeR16skt(cpu);
-  if (r16) {
-    CPU_PUSHW(cpu, *r16);
-  } else {
-    cpu->fc = cpu->f_c;
-    cpu->fh = cpu->f_h;
-    cpu->fn = cpu->f_n;
-    cpu->fz = cpu->f_z;
-
-    CPU_PUSHB(cpu, cpu->a);
-    CPU_PUSHB(cpu, cpu->f);
-    CPUTick(cpu, 4);
-  }
+GB_CPU_CALL_COND(NZ)
+GB_CPU_CALL_COND(Z)
+GB_CPU_CALL_COND(NC)
+GB_CPU_CALL_COND(C)
+
+#define GB_CPU_RST(target)                                                     \
+  static void CPU_RST_##target(CPU *cpu) { CPU_RST(cpu, 0x##target); }
+
+GB_CPU_RST(00)
+GB_CPU_RST(08)
+GB_CPU_RST(10)
+GB_CPU_RST(18)
+GB_CPU_RST(20)
+GB_CPU_RST(28)
+GB_CPU_RST(30)
+GB_CPU_RST(38)
+
+/* PUSH r16stk / POP r16stk, AF is handled separately */
+#define GB_CPU_R16STK_OPS(NAME, reg)                                           \
+  static void CPU_POP_##NAME(CPU *cpu) { cpu->reg = CPU_POPW(cpu); }           \
+                                                                               \
+  static void CPU_PUSH_##NAME(CPU *cpu) { CPU_PUSHW(cpu, cpu->reg); }
+
+GB_CPU_R16STK_OPS(BC, bc)
+GB_CPU_R16STK_OPS(DE, de)
+GB_CPU_R16STK_OPS(HL, hl)
+
+static void CPU_POP_AF(CPU *cpu) {
+  cpu->f = (CPU_POPB(cpu) & 0b11110000);
+  cpu->a = CPU_POPB(cpu);
+
+  /* Restore flags from memory (low 4 bits are ignored) */
+  CPUSetFlagZ(cpu, cpu->fz);
+  cpu->flag_n = cpu->fn;
+  CPUSetFlagH(cpu, cpu->fh);
+  CPUSetFlagC(cpu, cpu->fc);
+}
+
+static void CPU_PUSH_AF(CPU *cpu) {
+  cpu->fc = gb_cpu_flag_c(cpu);
+  cpu->fh = gb_cpu_flag_h(cpu);
+  cpu->fn = cpu->flag_n;
+  cpu->fz = gb_cpu_flag_z(cpu);
+
+  CPU_PUSHB(cpu, cpu->a);
+  CPU_PUSHB(cpu, cpu->f);
+  CPUTick(cpu, 4);
 }
 
 void CPU_LDH_MemC_A(CPU *cpu) {
@@ -934,11 +943,11 @@ uint16_t CPUAddSPsi8(CPU *cpu) {
   int32_t r = cpu->sp;
   r += i8;
 
-  cpu->f_z = false;
-  cpu->f_n = false;
+  CPUSetFlagZ(cpu, false);
+  cpu->flag_n = false;
   /* Carry and Half-carry are for the low byte */
-  cpu->f_h = (cpu->sp ^ i8 ^ r) & 0x10;
-  cpu->f_c = (cpu->sp ^ i8 ^ r) & 0x100;
+  CPUSetFlagHFrom(cpu, cpu->sp, i8, r);
+  cpu->flag_cr = cpu->sp ^ i8 ^ r;
 
   return (uint16_t)r;
 }
@@ -968,298 +977,351 @@ void CPU_EI(CPU *cpu) {
   cpu->irq_enable_next = true;
 }
 
-uint8_t cbOpcode;
-
-uint8_t *DecodeCBOperand(CPU *cpu) {
-  switch (cbOpcode & 0b00000111) {
-  case 0b00000000:
-    return &cpu->b;
-    break;
-  case 0b00000001:
-    return &cpu->c;
-    break;
-  case 0b00000010:
-    return &cpu->d;
-    break;
-  case 0b00000011:
-    return &cpu->e;
-    break;
-  case 0b00000100:
-    return &cpu->h;
-    break;
-  case 0b00000101:
-    return &cpu->l;
-    break;
-  case 0b00000110: // HL
-    return NULL;
-    break;
-  default: // case 0b00000111:
-    return &cpu->a;
-  }
-}
-
 void CPUCBRLCSetFlags(CPU *cpu, uint8_t *v) {
   uint8_t c = *v >> 7;
   *v = (*v << 1) | c;
-  cpu->f_z = (*v == 0);
-  cpu->f_n = false;
-  cpu->f_h = false;
-  cpu->f_c = c;
+  cpu->flag_zr = *v;
+  cpu->flag_n = false;
+  CPUSetFlagH(cpu, false);
+  CPUSetFlagC(cpu, c);
 }
 
 void CPUCBRRCSetFlags(CPU *cpu, uint8_t *v) {
   uint8_t c = *v & 1;
   *v = (*v >> 1) | (c << 7);
-  cpu->f_z = (*v == 0);
-  cpu->f_n = false;
-  cpu->f_h = false;
-  cpu->f_c = c;
+  cpu->flag_zr = *v;
+  cpu->flag_n = false;
+  CPUSetFlagH(cpu, false);
+  CPUSetFlagC(cpu, c);
 }
 
 void CPUCBRLSetFlags(CPU *cpu, uint8_t *v) {
   bool new_c = *v >> 7;
-  *v = (*v << 1) | (uint8_t)cpu->f_c;
-  cpu->f_z = (*v == 0);
-  cpu->f_n = false;
-  cpu->f_h = false;
-  cpu->f_c = new_c;
+  *v = (*v << 1) | (uint8_t)gb_cpu_flag_c(cpu);
+  cpu->flag_zr = *v;
+  cpu->flag_n = false;
+  CPUSetFlagH(cpu, false);
+  CPUSetFlagC(cpu, new_c);
 }
 
 void CPUCBRRSetFlags(CPU *cpu, uint8_t *v) {
   bool new_c = *v & 1;
-  uint8_t old_c = cpu->f_c;
+  uint8_t old_c = gb_cpu_flag_c(cpu);
   *v = (*v >> 1) | (old_c << 7);
-  cpu->f_z = (*v == 0);
-  cpu->f_n = false;
-  cpu->f_h = false;
-  cpu->f_c = new_c;
+  cpu->flag_zr = *v;
+  cpu->flag_n = false;
+  CPUSetFlagH(cpu, false);
+  CPUSetFlagC(cpu, new_c);
 }
 
 void CPUCBSLASetFlags(CPU *cpu, uint8_t *v) {
   bool c = *v >> 7;
   *v = *v << 1;
-  cpu->f_z = (*v == 0);
-  cpu->f_n = false;
-  cpu->f_h = false;
-  cpu->f_c = c;
+  cpu->flag_zr = *v;
+  cpu->flag_n = false;
+  CPUSetFlagH(cpu, false);
+  CPUSetFlagC(cpu, c);
 }
 
 void CPUCBSRASetFlags(CPU *cpu, uint8_t *v) {
   bool c = *v & 1;
   /* Sign-extend */
   *v = (*v >> 1) | (*v & 0x80);
-  cpu->f_z = (*v == 0);
-  cpu->f_n = false;
-  cpu->f_h = false;
-  cpu->f_c = c;
+  cpu->flag_zr = *v;
+  cpu->flag_n = false;
+  CPUSetFlagH(cpu, false);
+  CPUSetFlagC(cpu, c);
 }
 
 void CPUCBSWAPSetFlags(CPU *cpu, uint8_t *v) {
   *v = ((*v << 4) | (*v >> 4)) & 0xff;
-  cpu->f_z = (*v == 0);
-  cpu->f_n = false;
-  cpu->f_h = false;
-  cpu->f_c = false;
+  cpu->flag_zr = *v;
+  cpu->flag_n = false;
+  CPUSetFlagH(cpu, false);
+  CPUSetFlagC(cpu, false);
 }
 
 void CPUCBSRLSetFlags(CPU *cpu, uint8_t *v) {
   bool c = *v & 1;
   *v = *v >> 1;
-  cpu->f_z = (*v == 0);
-  cpu->f_n = false;
-  cpu->f_h = false;
-  cpu->f_c = c;
-}
-
-void CPU_CB_R8(CPU *cpu) {
-  void (*cbInstruction)(CPU *, uint8_t *) = NULL;
-  switch (cbOpcode & 0b11111000) {
-  case 0b00000000:
-    cbInstruction = CPUCBRLCSetFlags;
-    break;
-  case 0b00001000:
-    cbInstruction = CPUCBRRCSetFlags;
-    break;
-  case 0b00010000:
-    cbInstruction = CPUCBRLSetFlags;
-    break;
-  case 0b00011000:
-    cbInstruction = CPUCBRRSetFlags;
-    break;
-  case 0b00100000:
-    cbInstruction = CPUCBSLASetFlags;
-    break;
-  case 0b00101000:
-    cbInstruction = CPUCBSRASetFlags;
-    break;
-  case 0b00110000:
-    cbInstruction = CPUCBSWAPSetFlags;
-    break;
-  default: // 0b00111000
-    cbInstruction = CPUCBSRLSetFlags;
-    break;
-  }
-  uint8_t *r8 = DecodeCBOperand(cpu);
-  if (r8) {
-    cbInstruction(cpu, r8);
-  } else {
-    uint8_t value = MemoryRead(cpu->memory, cpu->hl);
-    cbInstruction(cpu, &value);
-    MemoryWrite(cpu->memory, cpu->hl, value);
-  }
+  cpu->flag_zr = *v;
+  cpu->flag_n = false;
+  CPUSetFlagH(cpu, false);
+  CPUSetFlagC(cpu, c);
 }
 
 void CPUBitSetFlags(CPU *cpu, uint8_t *v, uint8_t bit) {
-  bool set = *v & (1U << bit);
-  cpu->f_z = !set;
-  cpu->f_n = false;
-  cpu->f_h = true;
+  cpu->flag_zr = *v & (1U << bit);
+  cpu->flag_n = false;
+  CPUSetFlagH(cpu, true);
 }
 
 void CPUResSetFlags(CPU *, uint8_t *v, uint8_t bit) { *v = *v & ~(1U << bit); }
 
 void CPUSetSetFlags(CPU *, uint8_t *v, uint8_t bit) { *v = *v | (1U << bit); }
 
-void CPU_CB_BIT(CPU *cpu) {
-  void (*cbInstructionBit)(CPU *, uint8_t *, uint8_t) = NULL;
-  switch (cbOpcode & 0b11000000) {
-  case 0b01000000:
-    cbInstructionBit = CPUBitSetFlags;
-    break;
-  case 0b10000000:
-    cbInstructionBit = CPUResSetFlags;
-    break;
-  default: // 0b11000000:
-    cbInstructionBit = CPUSetSetFlags;
-    break;
+/* CB-prefixed rotations and shifts: RLC, RRC, RL, RR, SLA, SRA, SWAP and SRL
+ * r8 */
+#define GB_CPU_CB_R8(OP, NAME, reg)                                            \
+  static void CPU_CB_##OP##_##NAME(CPU *cpu) {                                 \
+    CPUCB##OP##SetFlags(cpu, &cpu->reg);                                       \
   }
-  uint8_t bit = (cbOpcode >> 3) & 0b111;
-  uint8_t *r8 = DecodeCBOperand(cpu);
-  if (r8) {
-    cbInstructionBit(cpu, r8, bit);
-  } else {
-    uint8_t value = MemoryRead(cpu->memory, cpu->hl);
-    cbInstructionBit(cpu, &value, bit);
-    MemoryWrite(cpu->memory, cpu->hl, value);
+
+#define GB_CPU_CB_MHL(OP)                                                      \
+  static void CPU_CB_##OP##_MHL(CPU *cpu) {                                    \
+    uint8_t value = MemoryRead(cpu->memory, cpu->hl);                          \
+    CPUCB##OP##SetFlags(cpu, &value);                                          \
+    MemoryWrite(cpu->memory, cpu->hl, value);                                  \
   }
-}
+
+#define GB_CPU_CB_ALL(OP)                                                      \
+  GB_CPU_CB_R8(OP, B, b)                                                       \
+  GB_CPU_CB_R8(OP, C, c)                                                       \
+  GB_CPU_CB_R8(OP, D, d)                                                       \
+  GB_CPU_CB_R8(OP, E, e)                                                       \
+  GB_CPU_CB_R8(OP, H, h)                                                       \
+  GB_CPU_CB_R8(OP, L, l)                                                       \
+  GB_CPU_CB_R8(OP, A, a)                                                       \
+  GB_CPU_CB_MHL(OP)
+
+GB_CPU_CB_ALL(RLC)
+GB_CPU_CB_ALL(RRC)
+GB_CPU_CB_ALL(RL)
+GB_CPU_CB_ALL(RR)
+GB_CPU_CB_ALL(SLA)
+GB_CPU_CB_ALL(SRA)
+GB_CPU_CB_ALL(SWAP)
+GB_CPU_CB_ALL(SRL)
+
+/* CB-prefixed BIT, RES and SET n, r8 */
+#define GB_CPU_CB_BIT_R8(OP, n, NAME, reg)                                     \
+  static void CPU_CB_##OP##_##n##_##NAME(CPU *cpu) {                           \
+    CPU##OP##SetFlags(cpu, &cpu->reg, n);                                      \
+  }
+
+/* XXX BIT n, [HL] writes the value back like RES and SET, which real hardware
+ * doesn't do */
+#define GB_CPU_CB_BIT_MHL(OP, n)                                               \
+  static void CPU_CB_##OP##_##n##_MHL(CPU *cpu) {                              \
+    uint8_t value = MemoryRead(cpu->memory, cpu->hl);                          \
+    CPU##OP##SetFlags(cpu, &value, n);                                         \
+    MemoryWrite(cpu->memory, cpu->hl, value);                                  \
+  }
+
+#define GB_CPU_CB_BIT_ALL_R8(OP, n)                                            \
+  GB_CPU_CB_BIT_R8(OP, n, B, b)                                                \
+  GB_CPU_CB_BIT_R8(OP, n, C, c)                                                \
+  GB_CPU_CB_BIT_R8(OP, n, D, d)                                                \
+  GB_CPU_CB_BIT_R8(OP, n, E, e)                                                \
+  GB_CPU_CB_BIT_R8(OP, n, H, h)                                                \
+  GB_CPU_CB_BIT_R8(OP, n, L, l)                                                \
+  GB_CPU_CB_BIT_R8(OP, n, A, a)                                                \
+  GB_CPU_CB_BIT_MHL(OP, n)
+
+#define GB_CPU_CB_BIT_ALL(OP)                                                  \
+  GB_CPU_CB_BIT_ALL_R8(OP, 0)                                                  \
+  GB_CPU_CB_BIT_ALL_R8(OP, 1)                                                  \
+  GB_CPU_CB_BIT_ALL_R8(OP, 2)                                                  \
+  GB_CPU_CB_BIT_ALL_R8(OP, 3)                                                  \
+  GB_CPU_CB_BIT_ALL_R8(OP, 4)                                                  \
+  GB_CPU_CB_BIT_ALL_R8(OP, 5)                                                  \
+  GB_CPU_CB_BIT_ALL_R8(OP, 6)                                                  \
+  GB_CPU_CB_BIT_ALL_R8(OP, 7)
+
+GB_CPU_CB_BIT_ALL(Bit)
+GB_CPU_CB_BIT_ALL(Res)
+GB_CPU_CB_BIT_ALL(Set)
+
+#define GB_CPU_CB_BIT_HANDLERS(OP)                                             \
+  {                                                                            \
+    GB_CPU_R8_HANDLERS(CPU_CB_##OP##_0), GB_CPU_R8_HANDLERS(CPU_CB_##OP##_1),  \
+        GB_CPU_R8_HANDLERS(CPU_CB_##OP##_2),                                   \
+        GB_CPU_R8_HANDLERS(CPU_CB_##OP##_3),                                   \
+        GB_CPU_R8_HANDLERS(CPU_CB_##OP##_4),                                   \
+        GB_CPU_R8_HANDLERS(CPU_CB_##OP##_5),                                   \
+        GB_CPU_R8_HANDLERS(CPU_CB_##OP##_6),                                   \
+        GB_CPU_R8_HANDLERS(CPU_CB_##OP##_7)                                    \
+  }
+
+/* Specialized CB handlers indexed by the operation and operand fields */
+static const CPUInstruction gb_cpu_cb_shift_handlers[8][8] = {
+    GB_CPU_R8_HANDLERS(CPU_CB_RLC), GB_CPU_R8_HANDLERS(CPU_CB_RRC),
+    GB_CPU_R8_HANDLERS(CPU_CB_RL),  GB_CPU_R8_HANDLERS(CPU_CB_RR),
+    GB_CPU_R8_HANDLERS(CPU_CB_SLA), GB_CPU_R8_HANDLERS(CPU_CB_SRA),
+    GB_CPU_R8_HANDLERS(CPU_CB_SWAP), GB_CPU_R8_HANDLERS(CPU_CB_SRL),
+};
+
+static const CPUInstruction gb_cpu_cb_bit_handlers[3][8][8] = {
+    GB_CPU_CB_BIT_HANDLERS(Bit),
+    GB_CPU_CB_BIT_HANDLERS(Res),
+    GB_CPU_CB_BIT_HANDLERS(Set),
+};
 
 CPUInstruction cpuCBInstructions[0x100];
 
 void CPUCBInit() {
   for (size_t indexOpcodeCB = 0; indexOpcodeCB < 0x100; indexOpcodeCB++) {
+    unsigned operation = (indexOpcodeCB >> 3) & 0b111;
+    unsigned operand = indexOpcodeCB & 0b111;
+
     if ((indexOpcodeCB & 0b11000000) == 0b00000000) {
-      cpuCBInstructions[indexOpcodeCB] = CPU_CB_R8;
+      cpuCBInstructions[indexOpcodeCB] =
+          gb_cpu_cb_shift_handlers[operation][operand];
     } else {
-      cpuCBInstructions[indexOpcodeCB] = CPU_CB_BIT;
+      cpuCBInstructions[indexOpcodeCB] =
+          gb_cpu_cb_bit_handlers[(indexOpcodeCB >> 6) - 1][operation][operand];
     }
   }
 }
 
 void CPU_CB(CPU *cpu);
 
+/* Specialized handlers indexed by the operand fields of the opcode */
+static const CPUInstruction gb_cpu_ld_r16_imm16_handlers[4] = {
+    LD_BC_IMM16, LD_DE_IMM16, LD_HL_IMM16, LD_SP_IMM16};
+static const CPUInstruction gb_cpu_inc_r16_handlers[4] =
+    GB_CPU_R16_HANDLERS(INC);
+static const CPUInstruction gb_cpu_dec_r16_handlers[4] =
+    GB_CPU_R16_HANDLERS(DEC);
+static const CPUInstruction gb_cpu_add_hl_r16_handlers[4] =
+    GB_CPU_R16_HANDLERS(ADD_HL);
+static const CPUInstruction gb_cpu_ld_mr16mem_a_handlers[4] = {
+    LD_MBC_A, LD_MDE_A, LD_MHLI_A, LD_MHLD_A};
+static const CPUInstruction gb_cpu_ld_a_mr16mem_handlers[4] = {
+    LD_A_MBC, LD_A_MDE, LD_A_MHLI, LD_A_MHLD};
+
+static const CPUInstruction gb_cpu_inc_r8_handlers[8] =
+    GB_CPU_R8_HANDLERS(INC);
+static const CPUInstruction gb_cpu_dec_r8_handlers[8] =
+    GB_CPU_R8_HANDLERS(DEC);
+static const CPUInstruction gb_cpu_ld_r8_imm8_handlers[8] = {
+    LD_B_IMM8, LD_C_IMM8, LD_D_IMM8,   LD_E_IMM8,
+    LD_H_IMM8, LD_L_IMM8, LD_MHL_IMM8, LD_A_IMM8};
+
+/* LD [HL], [HL] is HALT */
+static const CPUInstruction gb_cpu_ld_r8_r8_handlers[8][8] = {
+    GB_CPU_R8_HANDLERS(CPU_LD_B),
+    GB_CPU_R8_HANDLERS(CPU_LD_C),
+    GB_CPU_R8_HANDLERS(CPU_LD_D),
+    GB_CPU_R8_HANDLERS(CPU_LD_E),
+    GB_CPU_R8_HANDLERS(CPU_LD_H),
+    GB_CPU_R8_HANDLERS(CPU_LD_L),
+    {CPU_LD_MHL_B, CPU_LD_MHL_C, CPU_LD_MHL_D, CPU_LD_MHL_E, CPU_LD_MHL_H,
+     CPU_LD_MHL_L, CPU_HALT, CPU_LD_MHL_A},
+    GB_CPU_R8_HANDLERS(CPU_LD_A),
+};
+
+static const CPUInstruction gb_cpu_alu_handlers[8][8] = {
+    GB_CPU_R8_HANDLERS(CPU_ADD_A), GB_CPU_R8_HANDLERS(CPU_ADC_A),
+    GB_CPU_R8_HANDLERS(CPU_SUB_A), GB_CPU_R8_HANDLERS(CPU_SBC_A),
+    GB_CPU_R8_HANDLERS(CPU_AND_A), GB_CPU_R8_HANDLERS(CPU_XOR_A),
+    GB_CPU_R8_HANDLERS(CPU_OR_A),  GB_CPU_R8_HANDLERS(CPU_CP_A),
+};
+
+static const CPUInstruction gb_cpu_jr_cond_handlers[4] =
+    GB_CPU_COND_HANDLERS(CPU_JR, _IMM8);
+static const CPUInstruction gb_cpu_ret_cond_handlers[4] =
+    GB_CPU_COND_HANDLERS(CPU_RET, );
+static const CPUInstruction gb_cpu_jp_cond_handlers[4] =
+    GB_CPU_COND_HANDLERS(CPU_JP, _IMM16);
+static const CPUInstruction gb_cpu_call_cond_handlers[4] =
+    GB_CPU_COND_HANDLERS(CPU_CALL, _IMM16);
+
+static const CPUInstruction gb_cpu_rst_handlers[8] = {
+    CPU_RST_00, CPU_RST_08, CPU_RST_10, CPU_RST_18,
+    CPU_RST_20, CPU_RST_28, CPU_RST_30, CPU_RST_38};
+
+static const CPUInstruction gb_cpu_pop_r16stk_handlers[4] = {
+    CPU_POP_BC, CPU_POP_DE, CPU_POP_HL, CPU_POP_AF};
+static const CPUInstruction gb_cpu_push_r16stk_handlers[4] = {
+    CPU_PUSH_BC, CPU_PUSH_DE, CPU_PUSH_HL, CPU_PUSH_AF};
+
 void gb_cpu_init() {
   printf("Init function\n");
   memset(cpuInstructions, 0x00, 0x100 * sizeof(CPUInstruction));
   memset(cpuCBInstructions, 0x00, 0x100 * sizeof(CPUInstruction));
 
   for (size_t indexOpcode = 0; indexOpcode < 0x100; indexOpcode++) {
+    unsigned r16 = (indexOpcode >> 4) & 0b11;
+    unsigned r8 = (indexOpcode >> 3) & 0b111;
+    unsigned cond = (indexOpcode >> 3) & 0b11;
+    unsigned r8_source = indexOpcode & 0b111;
+
     uint8_t block0 = indexOpcode & 0b11001111;
     if (block0 == 0b00000001) {
-      cpuInstructions[indexOpcode] = LD_R16_IMM16;
+      cpuInstructions[indexOpcode] = gb_cpu_ld_r16_imm16_handlers[r16];
       continue;
     } else if (block0 == 0b00000010) {
-      cpuInstructions[indexOpcode] = LD_MR16MEM_A;
+      cpuInstructions[indexOpcode] = gb_cpu_ld_mr16mem_a_handlers[r16];
       continue;
     } else if (block0 == 0b00001010) {
-      cpuInstructions[indexOpcode] = LD_A_MR16MEM;
+      cpuInstructions[indexOpcode] = gb_cpu_ld_a_mr16mem_handlers[r16];
       continue;
     } else if (block0 == 0b00000011) {
-      cpuInstructions[indexOpcode] = INC_R16;
+      cpuInstructions[indexOpcode] = gb_cpu_inc_r16_handlers[r16];
       continue;
     } else if (block0 == 0b00001011) {
-      cpuInstructions[indexOpcode] = DEC_R16;
+      cpuInstructions[indexOpcode] = gb_cpu_dec_r16_handlers[r16];
       continue;
     } else if (block0 == 0b00001001) {
-      cpuInstructions[indexOpcode] = ADD_HL_R16;
+      cpuInstructions[indexOpcode] = gb_cpu_add_hl_r16_handlers[r16];
       continue;
     }
 
     block0 = indexOpcode & 0b11000111;
     if (block0 == 0b00000100) {
-      cpuInstructions[indexOpcode] = INC_R8;
+      cpuInstructions[indexOpcode] = gb_cpu_inc_r8_handlers[r8];
       continue;
     } else if (block0 == 0b00000101) {
-      cpuInstructions[indexOpcode] = DEC_R8;
+      cpuInstructions[indexOpcode] = gb_cpu_dec_r8_handlers[r8];
       continue;
     } else if (block0 == 0b00000110) {
-      cpuInstructions[indexOpcode] = LD_R8_IMM8;
+      cpuInstructions[indexOpcode] = gb_cpu_ld_r8_imm8_handlers[r8];
       continue;
     }
 
     block0 = indexOpcode & 0b11100111;
     if (block0 == 0b00100000) {
-      cpuInstructions[indexOpcode] = CPU_JR_COND_IMM8;
+      cpuInstructions[indexOpcode] = gb_cpu_jr_cond_handlers[cond];
       continue;
     }
 
     uint8_t block1 = indexOpcode & 0b11000000;
     if (block1 == 0b01000000) {
-      cpuInstructions[indexOpcode] = CPU_LD_R8_R8;
+      cpuInstructions[indexOpcode] = gb_cpu_ld_r8_r8_handlers[r8][r8_source];
       continue;
     }
 
-    uint8_t block2 = indexOpcode & 0b11111000;
+    uint8_t block2 = indexOpcode & 0b11000000;
     if (block2 == 0b10000000) {
-      cpuInstructions[indexOpcode] = CPU_ADD_A_R8;
-      continue;
-    } else if (block2 == 0b10001000) {
-      cpuInstructions[indexOpcode] = CPU_ADC_A_R8;
-      continue;
-    } else if (block2 == 0b10010000) {
-      cpuInstructions[indexOpcode] = CPU_SUB_A_R8;
-      continue;
-    } else if (block2 == 0b10011000) {
-      cpuInstructions[indexOpcode] = CPU_SBC_A_R8;
-      continue;
-    } else if (block2 == 0b10100000) {
-      cpuInstructions[indexOpcode] = CPU_AND_A_R8;
-      continue;
-    } else if (block2 == 0b10101000) {
-      cpuInstructions[indexOpcode] = CPU_XOR_A_R8;
-      continue;
-    } else if (block2 == 0b10110000) {
-      cpuInstructions[indexOpcode] = CPU_OR_A_R8;
-      continue;
-    } else if (block2 == 0b10111000) {
-      cpuInstructions[indexOpcode] = CPU_CP_A_R8;
+      cpuInstructions[indexOpcode] = gb_cpu_alu_handlers[r8][r8_source];
       continue;
     }
 
     uint8_t block3 = indexOpcode & 0b11100111;
     if (block3 == 0b11000000) {
-      cpuInstructions[indexOpcode] = CPU_RET_COND;
+      cpuInstructions[indexOpcode] = gb_cpu_ret_cond_handlers[cond];
       continue;
     } else if (block3 == 0b11000010) {
-      cpuInstructions[indexOpcode] = CPU_JP_COND_IMM16;
+      cpuInstructions[indexOpcode] = gb_cpu_jp_cond_handlers[cond];
       continue;
     } else if (block3 == 0b11000100) {
-      cpuInstructions[indexOpcode] = CPU_CALL_COND_IMM16;
+      cpuInstructions[indexOpcode] = gb_cpu_call_cond_handlers[cond];
       continue;
     }
 
     block3 = indexOpcode & 0b11000111;
     if (block3 == 0b11000111) {
-      cpuInstructions[indexOpcode] = CPU_RST_TGT3;
+      cpuInstructions[indexOpcode] = gb_cpu_rst_handlers[r8];
       continue;
     }
 
     block3 = indexOpcode & 0b11001111;
     if (block3 == 0b11000001) {
-      cpuInstructions[indexOpcode] = CPU_POP_R16stk;
+      cpuInstructions[indexOpcode] = gb_cpu_pop_r16stk_handlers[r16];
       continue;
     } else if (block3 == 0b11000101) {
-      cpuInstructions[indexOpcode] = CPU_PUSH_R16stk;
+      cpuInstructions[indexOpcode] = gb_cpu_push_r16stk_handlers[r16];
       continue;
     }
   }
@@ -1361,6 +1423,10 @@ static void gb_cpu_check_interrupts(struct gb *gb) {
   /*gb_cpu_pushw(gb, gb->cpu.pc);*/
   CPU_PUSHW(cpu, cpu->pc);
 
+  /* Events which became due during the push must run before the
+   * acknowledgement since they could trigger this interrupt again */
+  gb_cpu_sync_events(gb);
+
   /* We're about to handle this interrupt, acknowledge it */
   irq->irq_flags &= ~(1U << i);
 
@@ -1368,6 +1434,501 @@ static void gb_cpu_check_interrupts(struct gb *gb) {
   CPU_LOAD_PC(cpu, handler);
 }
 
+/***********************
+ * Basic block caching *
+ ***********************/
+
+/* Length in bytes of the instruction starting with `op` */
+static unsigned gb_cpu_insn_length(uint8_t op) {
+  switch (op) {
+  case 0x01: /* LD r16, imm16 */
+  case 0x11:
+  case 0x21:
+  case 0x31:
+  case 0x08: /* LD [imm16], SP */
+  case 0xc2: /* JP cond, imm16 */
+  case 0xca:
+  case 0xd2:
+  case 0xda:
+  case 0xc3: /* JP imm16 */
+  case 0xc4: /* CALL cond, imm16 */
+  case 0xcc:
+  case 0xd4:
+  case 0xdc:
+  case 0xcd: /* CALL imm16 */
+  case 0xea: /* LD [imm16], A */
+  case 0xfa: /* LD A, [imm16] */
+    return 3;
+  case 0x06: /* LD r8, imm8 */
+  case 0x0e:
+  case 0x16:
+  case 0x1e:
+  case 0x26:
+  case 0x2e:
+  case 0x36:
+  case 0x3e:
+  case 0x18: /* JR imm8 */
+  case 0x20: /* JR cond, imm8 */
+  case 0x28:
+  case 0x30:
+  case 0x38:
+  case 0xc6: /* ALU A, imm8 */
+  case 0xce:
+  case 0xd6:
+  case 0xde:
+  case 0xe6:
+  case 0xee:
+  case 0xf6:
+  case 0xfe:
+  case 0xe0: /* LDH [imm8], A */
+  case 0xf0: /* LDH A, [imm8] */
+  case 0xe8: /* ADD SP, imm8 */
+  case 0xf8: /* LD HL, SP + imm8 */
+  case 0xcb: /* CB prefix */
+    return 2;
+  default:
+    return 1;
+  }
+}
+
+/* Returns true if the instruction can change the PC or stop the CPU, in which
+ * case it must be the last one of its block */
+static bool gb_cpu_insn_ends_block(uint8_t op) {
+  switch (op) {
+  case 0x10: /* STOP */
+  case 0x76: /* HALT */
+  case 0x18: /* JR */
+  case 0x20:
+  case 0x28:
+  case 0x30:
+  case 0x38:
+  case 0xc2: /* JP */
+  case 0xc3:
+  case 0xca:
+  case 0xd2:
+  case 0xda:
+  case 0xe9:
+  case 0xc4: /* CALL */
+  case 0xcc:
+  case 0xcd:
+  case 0xd4:
+  case 0xdc:
+  case 0xc0: /* RET */
+  case 0xc8:
+  case 0xc9:
+  case 0xd0:
+  case 0xd8:
+  case 0xd9: /* RETI */
+    return true;
+  default:
+    /* RST */
+    return (op & 0b11000111) == 0b11000111;
+  }
+}
+
+/* Compute the cache key of the code at `pc` and the address where the memory
+ * region containing it ends. Returns false if code at this address can't be
+ * cached. */
+static bool gb_cpu_block_key(struct gb *gb, uint16_t pc, uint32_t *key,
+                             uint32_t *end) {
+  if (pc < 0x4000) {
+    /* ROM bank 0 */
+    *key = pc;
+    *end = 0x4000;
+  } else if (pc < 0x8000) {
+    /* Switchable ROM bank, the page table gives us the current mapping */
+    *key = gb->read_map[pc >> 8] - gb->cart.rom + (pc & 0xff);
+    *end = 0x8000;
+  } else if (pc >= 0xc000 && pc < 0xd000) {
+    /* Internal RAM bank 0 */
+    *key = GB_CPU_BLOCK_RAM | (pc - 0xc000);
+    *end = 0xd000;
+  } else if (pc >= 0xd000 && pc < 0xe000) {
+    /* Switchable internal RAM bank */
+    unsigned bank = gb->iram_high_bank;
+
+    if (bank == 0) {
+      bank = 1;
+    }
+
+    *key = GB_CPU_BLOCK_RAM | (pc - 0xc000 + (bank - 1) * 0x1000);
+    *end = 0xe000;
+  } else if (pc >= 0xff80 && pc < 0xffff) {
+    /* Zero page RAM, stored after the internal RAM */
+    *key = GB_CPU_BLOCK_RAM | (0x8000 + pc - 0xff80);
+    *end = 0xffff;
+  } else {
+    /* VRAM, cartridge RAM, echo RAM, OAM: not worth caching */
+    return false;
+  }
+
+  return true;
+}
+
+/* Returns true if `insn` can be part of a polling loop: it doesn't write to
+ * memory and only modifies A and the flags */
+static bool gb_cpu_insn_is_poll(const struct gb_cpu_insn *insn) {
+  uint8_t op = insn->opcode;
+
+  switch (op) {
+  case 0x00: /* NOP */
+  case 0x0a: /* LD A, [BC] */
+  case 0x1a: /* LD A, [DE] */
+  case 0x2f: /* CPL */
+  case 0xc6: /* ALU A, imm8 */
+  case 0xce:
+  case 0xd6:
+  case 0xde:
+  case 0xe6:
+  case 0xee:
+  case 0xf6:
+  case 0xfe:
+  case 0xf0: /* LDH A, [imm8] */
+  case 0xf2: /* LDH A, [C] */
+  case 0xfa: /* LD A, [imm16] */
+    return true;
+  case 0xcb:
+    /* BIT n, r8. BIT n, [HL] writes the value back to memory. */
+    return (insn->operands[0] & 0b11000000) == 0b01000000 &&
+           (insn->operands[0] & 0b111) != 0b110;
+  default:
+    /* LD A, r8 and ALU A, r8 */
+    return op >= 0x78 && op <= 0xbf;
+  }
+}
+
+/* Returns true if the block starting at `pc` is made of instructions which
+ * can be part of a polling loop followed by a jump back to `pc` */
+static bool gb_cpu_block_is_idle(const struct gb_cpu_block *block,
+                                 uint16_t pc) {
+  const struct gb_cpu_insn *last = &block->insns[block->n_insns - 1];
+  uint16_t addr = pc;
+  unsigned i;
+
+  for (i = 0; i < block->n_insns; i++) {
+    if (i < block->n_insns - 1U && !gb_cpu_insn_is_poll(&block->insns[i])) {
+      return false;
+    }
+
+    addr += block->insns[i].length;
+  }
+
+  switch (last->opcode) {
+  case 0x18: /* JR imm8 */
+  case 0x20: /* JR cond, imm8 */
+  case 0x28:
+  case 0x30:
+  case 0x38:
+    return ((addr + (int8_t)last->operands[0]) & 0xffff) == pc;
+  case 0xc3: /* JP imm16 */
+  case 0xc2: /* JP cond, imm16 */
+  case 0xca:
+  case 0xd2:
+  case 0xda:
+    return (last->operands[0] | (last->operands[1] << 8)) == pc;
+  default:
+    return false;
+  }
+}
+
+static void gb_cpu_block_decode(struct gb *gb, struct gb_cpu_block *block,
+                                uint16_t pc, uint32_t key, uint32_t end) {
+  struct gb_cpu *cpu = &gb->cpu;
+  uint32_t addr = pc;
+
+  block->key = key;
+  block->generation = cpu->ram_generation;
+  block->n_insns = 0;
+
+  while (block->n_insns < GB_CPU_BLOCK_MAX_INSNS) {
+    struct gb_cpu_insn *insn = &block->insns[block->n_insns];
+    uint8_t op = gb_memory_readb(gb, addr);
+    unsigned length = gb_cpu_insn_length(op);
+    unsigned i;
+
+    if (cpuInstructions[op] == NULL || addr + length > end) {
+      /* Invalid opcode or instruction crossing the region boundary, let the
+       * interpreter deal with it */
+      break;
+    }
+
+    insn->handler = cpuInstructions[op];
+    insn->opcode = op;
+    insn->length = length;
+    for (i = 1; i < length; i++) {
+      insn->operands[i - 1] = gb_memory_readb(gb, addr + i);
+    }
+
+    block->n_insns++;
+    addr += length;
+
+    if (gb_cpu_insn_ends_block(op)) {
+      break;
+    }
+  }
+
+  block->idle = block->n_insns > 0 && gb_cpu_block_is_idle(block, pc);
+
+  if (key & GB_CPU_BLOCK_RAM) {
+    /* Any write to this code must invalidate the block */
+    uint32_t first = (key & ~GB_CPU_BLOCK_RAM) >> GB_CPU_CODE_PAGE_SHIFT;
+    uint32_t last = ((key & ~GB_CPU_BLOCK_RAM) + (addr - pc)) >>
+                    GB_CPU_CODE_PAGE_SHIFT;
+
+    for (uint32_t p = first; p <= last && p < GB_CPU_CODE_PAGES; p++) {
+      uint32_t off = p << GB_CPU_CODE_PAGE_SHIFT;
+
+      if (!cpu->ram_code_pages[p] && off < sizeof(gb->iram)) {
+        /* Writes to this page must now go through the slow path */
+        gb_memory_unmap_iram_write(gb, off);
+      }
+
+      cpu->ram_code_pages[p] = 1;
+    }
+  }
+}
+
+/* Return the cached block starting at the current PC, decoding it if
+ * necessary. Returns NULL if the code can't be cached. */
+static struct gb_cpu_block *gb_cpu_get_block(struct gb *gb) {
+  struct gb_cpu *cpu = &gb->cpu;
+  struct gb_cpu_block *block;
+  uint32_t key;
+  uint32_t end;
+
+  if (!gb_cpu_block_key(gb, cpu->pc, &key, &end)) {
+    return NULL;
+  }
+
+  block = &cpu->blocks[(key ^ (key >> 10) ^ (key >> 20)) &
+                       (GB_CPU_BLOCK_CACHE_SIZE - 1)];
+
+  if (block->n_insns == 0 || block->key != key ||
+      ((key & GB_CPU_BLOCK_RAM) &&
+       block->generation != cpu->ram_generation)) {
+    gb_cpu_block_decode(gb, block, cpu->pc, key, end);
+  }
+
+  if (block->n_insns == 0) {
+    return NULL;
+  }
+
+  return block;
+}
+
+/* Called when cached code in RAM is overwritten */
+void gb_cpu_invalidate_ram_code(struct gb *gb) {
+  struct gb_cpu *cpu = &gb->cpu;
+
+  cpu->ram_generation++;
+  memset(cpu->ram_code_pages, 0, sizeof(cpu->ram_code_pages));
+  cpu->block_exit = true;
+
+  gb_memory_map_iram(gb);
+}
+
+/* Opcode fetch of an instruction running from the block cache */
+static void gb_cpu_block_fetch(struct gb *gb, unsigned op,
+                               const uint8_t *operands) {
+  struct gb_cpu *cpu = &gb->cpu;
+
+  cpu->opcode = op;
+  cpu->pc = (cpu->pc + 1) & 0xffff;
+  CPUTick(cpu, 4);
+
+  cpu->operands = operands;
+}
+
+/* Same checks as the main loop between two instructions. Returns non-zero if
+ * the block must be left and control given back to the main loop. */
+static int gb_cpu_block_next(struct gb *gb, int32_t cycles) {
+  struct gb_cpu *cpu = &gb->cpu;
+  struct gb_irq *irq = &gb->irq;
+
+  gb_cpu_sync_events(gb);
+
+  if (cpu->block_exit || gb->timestamp >= cycles ||
+      (cpu->irq_enable && (irq->irq_enable & irq->irq_flags & 0x1f))) {
+    return 1;
+  }
+
+  cpu->irq_enable = cpu->irq_enable_next;
+
+  return 0;
+}
+
+/* Run the instructions of `block` until we reach its end or something happens
+ * that the main loop has to handle (interrupt, end of the time slice, code
+ * modification) */
+static void gb_cpu_run_block(struct gb *gb, const struct gb_cpu_block *block,
+                             int32_t cycles) {
+  struct gb_cpu *cpu = &gb->cpu;
+  unsigned i;
+
+  cpu->block_exit = false;
+
+  for (i = 0; i < block->n_insns; i++) {
+    const struct gb_cpu_insn *insn = &block->insns[i];
+
+    if (i > 0 && gb_cpu_block_next(gb, cycles)) {
+      break;
+    }
+
+    gb_cpu_block_fetch(gb, insn->opcode, insn->operands);
+    insn->handler(cpu);
+  }
+
+  cpu->operands = NULL;
+  gb_cpu_sync_events(gb);
+}
+
+/* Returns true if reading `addr` has no side effect and always returns the
+ * same value as long as the CPU doesn't write to memory and no event is
+ * processed */
+static bool gb_cpu_idle_read_ok(uint16_t addr) {
+  if (addr < 0x8000) {
+    /* ROM */
+    return true;
+  }
+
+  if (addr >= 0xc000 && addr < 0xfe00) {
+    /* Internal RAM and its echo */
+    return true;
+  }
+
+  if (addr >= 0xff80) {
+    /* Zero page RAM and IE */
+    return true;
+  }
+
+  switch (addr) {
+  case 0xff00: /* Input, only refreshed between calls to gb_cpu_run_cycles */
+  case 0xff0f: /* IF */
+  case 0xff40: /* LCDC */
+  case 0xff44: /* LY, only changes at the end of a line which is a GPU event */
+  case 0xff45: /* LYC */
+    return true;
+  default:
+    /* STAT, DIV, TIMA, the sound registers... change between events */
+    return false;
+  }
+}
+
+/* Check the addresses read by a polling loop. Since these instructions don't
+ * modify BC, DE and HL the current values of these registers are the ones
+ * used by the loop. */
+static bool gb_cpu_block_reads_ok(struct gb *gb,
+                                  const struct gb_cpu_block *block) {
+  struct gb_cpu *cpu = &gb->cpu;
+  unsigned i;
+
+  for (i = 0; i < block->n_insns; i++) {
+    const struct gb_cpu_insn *insn = &block->insns[i];
+    uint16_t addr;
+
+    switch (insn->opcode) {
+    case 0x0a: /* LD A, [BC] */
+      addr = cpu->bc;
+      break;
+    case 0x1a: /* LD A, [DE] */
+      addr = cpu->de;
+      break;
+    case 0xf0: /* LDH A, [imm8] */
+      addr = 0xff00 | insn->operands[0];
+      break;
+    case 0xf2: /* LDH A, [C] */
+      addr = 0xff00 | cpu->c;
+      break;
+    case 0xfa: /* LD A, [imm16] */
+      addr = insn->operands[0] | (insn->operands[1] << 8);
+      break;
+    default:
+      if (insn->opcode == 0x7e || (insn->opcode & 0b11000111) == 0x86) {
+        /* LD A, [HL] and ALU A, [HL] */
+        addr = cpu->hl;
+        break;
+      }
+      /* No memory access */
+      continue;
+    }
+
+    if (!gb_cpu_idle_read_ok(addr)) {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+/* Run a block flagged as a potential polling loop. If an iteration ends where
+ * it started with all the registers unchanged, then all the following
+ * iterations will do exactly the same thing until an event or an interrupt
+ * changes the memory being polled. In this case we can skip all the
+ * iterations which would complete before the next event or `cycles`, like the
+ * halted mode does. */
+static void gb_cpu_run_idle_block(struct gb *gb, struct gb_cpu_block *block,
+                                  int32_t cycles) {
+  struct gb_cpu *cpu = &gb->cpu;
+  struct gb_irq *irq = &gb->irq;
+  /* The only state a polling loop can modify */
+  uint16_t pc = cpu->pc;
+  uint8_t a = cpu->a;
+  uint8_t flag_zr = cpu->flag_zr;
+  bool flag_n = cpu->flag_n;
+  uint8_t flag_ha = cpu->flag_ha;
+  uint8_t flag_hb = cpu->flag_hb;
+  uint8_t flag_hr = cpu->flag_hr;
+  uint16_t flag_cr = cpu->flag_cr;
+  int32_t start = gb->timestamp;
+  int32_t first_event = gb->sync.first_event;
+  int32_t iteration;
+  int32_t limit;
+  int32_t n;
+
+  gb_cpu_run_block(gb, block, cycles);
+
+  if (cpu->pc != pc || cpu->block_exit || cpu->a != a ||
+      cpu->flag_zr != flag_zr || cpu->flag_n != flag_n ||
+      cpu->flag_ha != flag_ha || cpu->flag_hb != flag_hb ||
+      cpu->flag_hr != flag_hr || cpu->flag_cr != flag_cr) {
+    /* Not a fixed point (yet) */
+    return;
+  }
+
+  if (first_event <= gb->timestamp) {
+    /* An event ran during this iteration, possibly after the polled value
+     * was read */
+    return;
+  }
+
+  if (cpu->irq_enable != cpu->irq_enable_next ||
+      (cpu->irq_enable && (irq->irq_enable & irq->irq_flags & 0x1f))) {
+    /* The interrupt state is about to change */
+    return;
+  }
+
+  iteration = gb->timestamp - start;
+
+  limit = gb->sync.first_event;
+  if (cycles < limit) {
+    limit = cycles;
+  }
+
+  if (gb->timestamp + iteration >= limit) {
+    /* Not even one iteration to skip */
+    return;
+  }
+
+  if (!gb_cpu_block_reads_ok(gb, block)) {
+    return;
+  }
+
+  /* Skip the iterations which complete strictly before `limit` */
+  n = (limit - 1 - gb->timestamp) / iteration;
+
+  gb_cpu_clock_tick(gb, (n * iteration) << gb->double_speed);
+}
+
 int32_t gb_cpu_run_cycles(struct gb *gb, int32_t cycles) {
   struct gb_cpu *cpu = &gb->cpu;
   /* Rebase the synchronization timestamps, which has the side effect of
@@ -1398,9 +1959,22 @@ int32_t gb_cpu_run_cycles(struct gb *gb, int32_t cycles) {
       gb_sync_check_events(gb);
 
     } else {
-      opcode = CPUReadNextI8(&gb->cpu);
-      CPUInstruction instruction = cpuInstructions[opcode];
-      instruction(&gb->cpu);
+      struct gb_cpu_block *block = NULL;
+
+      if (cpu->block_cache_enable) {
+        block = gb_cpu_get_block(gb);
+      }
+
+      if (block && block->idle && cpu->idle_skip_enable) {
+        gb_cpu_run_idle_block(gb, block, cycles);
+      } else if (block) {
+        gb_cpu_run_block(gb, block, cycles);
+      } else {
+        cpu->opcode = CPUReadNextI8(&gb->cpu);
+        CPUInstruction instruction = cpuInstructions[cpu->opcode];
+        instruction(&gb->cpu);
+        gb_cpu_sync_events(gb);
+      }
     }
   }
 
@@ -1408,7 +1982,7 @@ int32_t gb_cpu_run_cycles(struct gb *gb, int32_t cycles) {
 }
 
 void CPU_CB(CPU *cpu) {
-  cbOpcode = CPUReadNextI8(cpu);
-  CPUInstruction cpuCBInstruction = cpuCBInstructions[cbOpcode];
+  cpu->cb_opcode = CPUReadNextI8(cpu);
+  CPUInstruction cpuCBInstruction = cpuCBInstructions[cpu->cb_opcode];
   cpuCBInstruction(cpu);
 }
@@ -6,6 +6,54 @@
 
 typedef struct gb Memory;
 
+struct gb_cpu;
+
+typedef void (*CPUInstruction)(struct gb_cpu *cpu);
+
+/* Maximum number of instructions in a cached basic block */
+#define GB_CPU_BLOCK_MAX_INSNS 16
+/* Number of entries in the basic block cache, must be a power of two */
+#define GB_CPU_BLOCK_CACHE_SIZE 1024
+/* Set in the key of the blocks located in RAM */
+#define GB_CPU_BLOCK_RAM 0x80000000U
+
+/* Code in RAM is tracked in pages of 1 << GB_CPU_CODE_PAGE_SHIFT bytes: a write
+ * in a page containing cached code invalidates the RAM blocks */
+#define GB_CPU_CODE_PAGE_SHIFT 6
+/* Pages covering the 32KiB of internal RAM followed by the zero page RAM */
+#define GB_CPU_CODE_PAGES ((0x8000 >> GB_CPU_CODE_PAGE_SHIFT) + 2)
+
+/* Build with -DGB_CPU_EAGER_SYNC to process the sync events right after the
+ * memory access that makes them due instead of at the end of the
+ * instruction */
+
+/* Pre-decoded instruction */
+struct gb_cpu_insn {
+  CPUInstruction handler;
+  uint8_t opcode;
+  /* Immediate operands, including the second byte of CB opcodes */
+  uint8_t operands[2];
+  /* Instruction length in bytes */
+  uint8_t length;
+};
+
+/* Straight-line sequence of instructions ending with a jump, call, return or
+ * halt */
+struct gb_cpu_block {
+  /* ROM offset of the first instruction for blocks in ROM, RAM offset with
+   * GB_CPU_BLOCK_RAM set for blocks in RAM */
+  uint32_t key;
+  /* Value of `ram_generation` when a RAM block was decoded */
+  uint32_t generation;
+  /* Number of instructions in `insns`, 0 if this entry is unused */
+  uint8_t n_insns;
+  /* True if the block is a loop back to its first instruction that only
+   * reads memory and modifies A and the flags, i.e. a potential polling
+   * loop */
+  bool idle;
+  struct gb_cpu_insn insns[GB_CPU_BLOCK_MAX_INSNS];
+};
+
 typedef struct gb_cpu {
   union {
     uint16_t af;
@@ -53,14 +101,20 @@ typedef struct gb_cpu {
   };
   uint16_t pc;
 
-  /* Zero flag */
-  bool f_z;
+  /* The Z, H and C flags are evaluated lazily: instructions only store the
+   * values they are derived from and gb_cpu_flag_* compute them when they
+   * are actually needed. */
+  /* Result of the last instruction affecting Z, the flag is set if it's 0 */
+  uint8_t flag_zr;
   /* Substract flag */
-  bool f_n;
-  /* Half-Carry flag */
-  bool f_h;
-  /* Carry flag */
-  bool f_c;
+  bool flag_n;
+  /* Operands and result of the last instruction affecting H, the flag is bit
+   * 4 of flag_ha ^ flag_hb ^ flag_hr */
+  uint8_t flag_ha;
+  uint8_t flag_hb;
+  uint8_t flag_hr;
+  /* Result of the last instruction affecting C, the flag is bit 8 */
+  uint16_t flag_cr;
 
   /* Interrupt Master Enable (IME) flag */
   bool irq_enable;
@@ -70,13 +124,57 @@ typedef struct gb_cpu {
   /* True if the CPU is currently halted */
   bool halted;
 
+  /* Opcode of the instruction being executed */
+  uint8_t opcode;
+  /* Second byte of the CB-prefixed instruction being executed */
+  uint8_t cb_opcode;
+
   Memory *memory;
+
+  /* If true straight-line code in ROM and RAM is decoded once into `blocks`
+   * and executed from there */
+  bool block_cache_enable;
+  /* Operands of the instruction being executed from the block cache, NULL
+   * when the instruction is fetched from memory */
+  const uint8_t *operands;
+  /* Set when a memory write may have changed the code of the block being
+   * executed (ROM bank switch, write to cached RAM code...) */
+  bool block_exit;
+  /* Incremented every time cached code in RAM is modified, RAM blocks decoded
+   * with a different generation are stale */
+  uint32_t ram_generation;
+  /* Non-zero for the RAM pages containing cached code */
+  uint8_t ram_code_pages[GB_CPU_CODE_PAGES];
+  /* If true the polling loops detected by the block cache are skipped up
+   * to the next event */
+  bool idle_skip_enable;
+  /* Direct-mapped basic block cache */
+  struct gb_cpu_block blocks[GB_CPU_BLOCK_CACHE_SIZE];
 } CPU;
 
+/* Zero flag */
+static inline bool gb_cpu_flag_z(const struct gb_cpu *cpu) {
+  return cpu->flag_zr == 0;
+}
+
+/* Substract flag */
+static inline bool gb_cpu_flag_n(const struct gb_cpu *cpu) {
+  return cpu->flag_n;
+}
+
+/* Half-Carry flag */
+static inline bool gb_cpu_flag_h(const struct gb_cpu *cpu) {
+  return (cpu->flag_ha ^ cpu->flag_hb ^ cpu->flag_hr) & 0x10;
+}
+
+/* Carry flag */
+static inline bool gb_cpu_flag_c(const struct gb_cpu *cpu) {
+  return cpu->flag_cr & 0x100;
+}
+
 void gb_cpu_init();
 void gb_cpu_reset(struct gb *gb);
 int32_t gb_cpu_run_cycles(struct gb *gb, int32_t cycles);
-
-typedef void (*CPUInstruction)(CPU *cpu);
+void gb_cpu_invalidate_ram_code(struct gb *gb);
 
 #endif /* _GB_CPU_H_ */
@@ -5,6 +5,8 @@
 void gb_dma_reset(struct gb *gb) {
      struct gb_dma *dma = &gb->dma;
 
+     gb_sync_register(gb, GB_SYNC_DMA, gb_dma_sync);
+
      dma->running = false;
      dma->source = 0;
      dma->position = 0;
@@ -30,6 +32,7 @@ void gb_dma_sync(struct gb *gb) {
           uint32_t b = gb_memory_readb(gb, dma->source + dma->position);
 
           gb->gpu.oam[dma->position] = b;
+          gb_gpu_oam_written(gb, dma->position);
 
           length--;
           dma->position++;
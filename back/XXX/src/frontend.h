@@ -8,6 +8,10 @@ struct gb_frontend {
      /* Draw a single line in GBC mode */
      void (*draw_line_gbc)(struct gb *gb, unsigned ly,
                            union gb_gpu_color col[GB_LCD_WIDTH]);
+     /* Optional, draw a single line in GBC mode as host xRGB 8888 pixels. If
+      * set it's used instead of `draw_line_gbc`. */
+     void (*draw_line_xrgb8888)(struct gb *gb, unsigned ly,
+                                const uint32_t pixels[GB_LCD_WIDTH]);
      /* Called when we're done drawing a frame and it's ready to be displayed */
      void (*flip)(struct gb *gb);
      /* Handle user input */
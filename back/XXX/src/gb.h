@@ -6,6 +6,8 @@
 #include <stdbool.h>
 #include <stdio.h>
 #include <semaphore.h>
+#include <pthread.h>
+#include <stdatomic.h>
 
 struct gb;
 
@@ -16,6 +18,7 @@ struct gb;
 #include "rtc.h"
 #include "cart.h"
 #include "gpu.h"
+#include "pixel.h"
 #include "input.h"
 #include "dma.h"
 #include "hdma.h"
@@ -63,6 +66,15 @@ struct gb {
      uint8_t vram[0x4000];
      /* Always false on DMG */
      bool    vram_high_bank;
+     /* Host address of each 256-byte page of the CPU address space for
+      * direct reads and writes, NULL if accesses to the page have side
+      * effects and must go through the slow path. Updated by the
+      * gb_memory_map_* functions when the banking changes. */
+     const uint8_t *read_map[0x100];
+     uint8_t *write_map[0x100];
+     /* Value of the last register computed by MemoryRead1, which returns it
+      * by address */
+     uint8_t read_latch;
 };
 
 static inline void die(void) {
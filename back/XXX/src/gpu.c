@@ -1,4 +1,5 @@
 #include <stdio.h>
+#include <string.h>
 #include "gb.h"
 
 /* GPU timings:
@@ -39,10 +40,69 @@
 /* Total number of lines (including vertical blanking) */
 #define VTOTAL (VSYNC_START + VSYNC_LINES)
 
+static void gb_gpu_raster_reset(struct gb *gb, struct gb_gpu_raster *raster,
+                                const uint8_t *vram, const uint8_t *oam) {
+     unsigned i;
+
+     raster->gbc = gb->gbc;
+     raster->vram = vram;
+     raster->oam = oam;
+
+     for (i = 0; i < GB_GPU_CACHE_TILES; i++) {
+          raster->tile_dirty[i] = true;
+     }
+
+     raster->sprites_dirty = true;
+}
+
+/* Must be called after every write at offset `off` in the rasterizer's
+ * VRAM */
+static void gb_gpu_raster_vram_written(struct gb_gpu_raster *raster,
+                                       uint16_t off) {
+     unsigned bank = off / 0x2000;
+     unsigned bank_off = off % 0x2000;
+
+     if (bank_off < GB_GPU_BANK_TILES * 16) {
+          raster->tile_dirty[bank * GB_GPU_BANK_TILES + bank_off / 16] = true;
+     }
+}
+
+/* Get the frame being recorded, waiting for the render thread to be done
+ * with it if we haven't started recording it yet */
+static struct gb_gpu_frame *gb_gpu_record_frame(
+     struct gb_gpu_render_thread *rt) {
+
+     struct gb_gpu_frame *frame = &rt->frames[rt->record_index];
+
+     if (!rt->recording) {
+          sem_wait(&frame->free);
+          frame->n_lines = 0;
+          frame->n_writes = 0;
+          frame->flip = false;
+          frame->quit = false;
+          rt->recording = true;
+     }
+
+     return frame;
+}
+
+/* Hand the frame being recorded over to the render thread */
+static void gb_gpu_submit_frame(struct gb_gpu_render_thread *rt, bool flip) {
+     struct gb_gpu_frame *frame = gb_gpu_record_frame(rt);
+
+     frame->flip = flip;
+     sem_post(&frame->ready);
+
+     rt->record_index = (rt->record_index + 1) % GB_GPU_RENDER_FRAMES;
+     rt->recording = false;
+}
+
 void gb_gpu_reset(struct gb *gb) {
      struct gb_gpu *gpu = &gb->gpu;
      unsigned i;
 
+     gb_sync_register(gb, GB_SYNC_GPU, gb_gpu_sync);
+
      gpu->scx = 0;
      gpu->scy = 0;
      gpu->iten_lyc = false;
@@ -65,10 +125,63 @@ void gb_gpu_reset(struct gb *gb) {
      gpu->wx = 0;
      gpu->wy = 0;
      gpu->line_pos = 0;
+     gpu->skip_count = 0;
+     gpu->skip_frame = gpu->skip_period > 0 && gpu->skip_frames > 0;
+
+     for (i = 0; i < 8 * 4; i++) {
+          struct gb_color_palette *bg = &gpu->bg_palettes;
+          struct gb_color_palette *sprite = &gpu->sprite_palettes;
+
+          bg->host_colors[i / 4][i % 4] =
+               gb_pixel_gbc_color_to_xrgb8888(bg->colors[i / 4][i % 4]);
+          sprite->host_colors[i / 4][i % 4] =
+               gb_pixel_gbc_color_to_xrgb8888(sprite->colors[i / 4][i % 4]);
+     }
 
      for (i = 0; i < sizeof(gpu->oam); i++) {
           gpu->oam[i] = 0;
      }
+
+     gb_gpu_raster_reset(gb, &gpu->raster, gb->vram, gpu->oam);
+}
+
+/* Record a VRAM or OAM write for the render thread */
+static void gb_gpu_record_write(struct gb *gb, uint16_t off, uint8_t val) {
+     struct gb_gpu_render_thread *rt = gb->gpu.render_thread;
+     struct gb_gpu_frame *frame = gb_gpu_record_frame(rt);
+
+     if (frame->n_writes >= GB_GPU_FRAME_WRITES) {
+          /* No more room, send what we have so far */
+          gb_gpu_submit_frame(rt, false);
+          frame = gb_gpu_record_frame(rt);
+     }
+
+     frame->writes[frame->n_writes].off = off;
+     frame->writes[frame->n_writes].val = val;
+     frame->n_writes++;
+}
+
+/* Must be called after every write at offset `off` in the VRAM (including the
+ * bank offset) */
+void gb_gpu_vram_written(struct gb *gb, uint16_t off) {
+     struct gb_gpu *gpu = &gb->gpu;
+
+     if (gpu->render_thread) {
+          gb_gpu_record_write(gb, off, gb->vram[off]);
+     } else {
+          gb_gpu_raster_vram_written(&gpu->raster, off);
+     }
+}
+
+/* Must be called after every write at offset `off` in the OAM */
+void gb_gpu_oam_written(struct gb *gb, uint16_t off) {
+     struct gb_gpu *gpu = &gb->gpu;
+
+     if (gpu->render_thread) {
+          gb_gpu_record_write(gb, off | GB_GPU_WRITE_OAM, gpu->oam[off]);
+     } else {
+          gpu->raster.sprites_dirty = true;
+     }
 }
 
 static uint8_t gb_gpu_get_mode(struct gb *gb) {
@@ -93,25 +206,25 @@ static uint8_t gb_gpu_get_mode(struct gb *gb) {
      return 0;
 }
 
-struct gb_gpu_pixel {
-     union gb_gpu_color color;
-     bool opaque;
-     /* GBC only: true if the background pixel has priority */
-     bool priority;
-};
-
-/* Get a pixel value from the tileset */
-static enum gb_color gb_gpu_get_tile_color(struct gb *gb,
-                                           uint8_t tile_index,
-                                           uint8_t x, uint8_t y,
-                                           bool use_sprite_ts,
-                                           bool use_high_bank) {
+/* The line is first drawn as indices in a table holding the colors of all
+ * the palettes, which is then mapped in one pass at the end of the line. On
+ * the DMG the table holds the shades of BGP, OBP0 and OBP1, on the GBC the 8
+ * background palettes followed by the 8 sprite palettes. The last palette is
+ * used for the blank pixels drawn when the background is disabled. */
+#define GB_GPU_LINE_PAL_OBP0        1
+#define GB_GPU_LINE_PAL_OBP1        2
+#define GB_GPU_LINE_PAL_DMG_BLANK   3
+#define GB_GPU_LINE_PAL_GBC_SPRITES 8
+#define GB_GPU_LINE_PAL_GBC_BLANK   16
+
+/* Get the VRAM offset of a tile in the tileset */
+static unsigned gb_gpu_get_tile_addr(uint8_t tile_index,
+                                     bool use_sprite_ts,
+                                     bool use_high_bank) {
      unsigned tile_addr;
      /* Each tile is 8x8 pixels and stores 2bits per pixels for a total of
       * 16bytes per tile */
      const unsigned tile_size = 16;
-     unsigned lsb;
-     unsigned msb;
 
      if (use_sprite_ts) {
           /* Sprite tile set starts at the beginning of VRAM */
@@ -130,15 +243,23 @@ static enum gb_color gb_gpu_get_tile_color(struct gb *gb,
           tile_addr += 0x2000;
      }
 
-     /* Pixel data is stored "backwards" in VRAM: the leftmost pixel (x = 0) is
-      * stored in the MSB (byte >> 7) */
-     x = 7 - x;
+     return tile_addr;
+}
 
-     /* The pixel value is two bits split across two contiguous bytes */
-     lsb = (gb->vram[tile_addr + y * 2 + 0] >> x) & 1;
-     msb = (gb->vram[tile_addr + y * 2 + 1] >> x) & 1;
+/* Get the decoded row `y` of the tile at VRAM offset `tile_addr`, decoding
+ * the tile first if it has been modified. Flipped tiles are handled by the
+ * callers by reading the rows and pixels backwards. */
+static const uint8_t *gb_gpu_get_tile_row(struct gb_gpu_raster *raster,
+                                          unsigned tile_addr, unsigned y) {
+     unsigned index = (tile_addr / 0x2000) * GB_GPU_BANK_TILES +
+          (tile_addr % 0x2000) / 16;
+
+     if (raster->tile_dirty[index]) {
+          gb_pixel_decode_tile(raster->vram + tile_addr, raster->tiles[index]);
+          raster->tile_dirty[index] = false;
+     }
 
-     return (msb << 1) | lsb;
+     return raster->tiles[index][y];
 }
 
 static enum gb_color gb_gpu_palette_transform(enum gb_color color,
@@ -148,98 +269,101 @@ static enum gb_color gb_gpu_palette_transform(enum gb_color color,
      return (palette >> off) & 3;
 }
 
-static struct gb_gpu_pixel gb_gpu_get_bg_win_pixel(struct gb *gb,
-                                                   uint8_t x, uint8_t y,
-                                                   bool use_high_tm) {
-     struct gb_gpu *gpu = &gb->gpu;
+/* Flip a decoded tile row horizontally */
+static uint64_t gb_gpu_flip_row(uint64_t row) {
+     return __builtin_bswap64(row);
+}
 
-     /* Coordinates of the tile in the tile map (each tile is 8x8 pixels) */
-     unsigned tile_map_x = x / 8;
-     unsigned tile_map_y = y / 8;
-     /* Coordinates of the pixel within the tile */
-     unsigned tile_x = x % 8;
-     unsigned tile_y = y % 8;
-     /* Offset of the tile map entry in the VRAM */
-     unsigned tm_addr;
-     /* Index of the tile entry in the tile set */
-     uint8_t tile_index;
-     struct gb_gpu_pixel pix;
-     bool use_sprite_ts = gpu->bg_window_use_sprite_ts;
+/* Draw the background or window pixels from `start` to `end` (excluded) of
+ * the current line in `index` and, on the GBC, the priority attribute of each
+ * pixel in `priority`. `map_x` and `map_y` are the coordinates of the pixel at
+ * `start` in the tile map. Each tile row is fetched once and its 8 pixels are
+ * emitted with a single store. */
+static void gb_gpu_draw_bg_win(struct gb_gpu_raster *raster,
+                               const struct gb_gpu_line_regs *regs,
+                               uint8_t index[GB_LCD_WIDTH],
+                               uint8_t priority[GB_LCD_WIDTH],
+                               unsigned start, unsigned end,
+                               uint8_t map_x, uint8_t map_y,
+                               bool use_high_tm) {
+     bool use_sprite_ts = regs->bg_window_use_sprite_ts;
+     /* Whole tiles are drawn in these buffers, starting with the tile
+      * containing `start` */
+     uint8_t index_buf[GB_LCD_WIDTH + 8];
+     uint8_t priority_buf[GB_LCD_WIDTH + 8];
+     /* Position of `start` in its tile */
+     unsigned first = map_x % 8;
+     /* Number of pixels to draw in the buffers */
+     unsigned n = first + (end - start);
+     /* Column of the tile in the tile map */
+     unsigned tile_map_x = map_x / 8;
+     /* Row of the pixels within the tiles */
+     unsigned tile_y = map_y % 8;
+     /* Offset of the tile map line in the VRAM */
+     unsigned tm_line;
+     unsigned x;
 
      /* There are two independent tile maps the game can use */
      if (use_high_tm) {
-          tm_addr = 0x1c00;
+          tm_line = 0x1c00;
      } else {
-          tm_addr = 0x1800;
+          tm_line = 0x1800;
      }
 
      /* The tile map is a square map of 32*32 tiles. For each tile it contains
       * one byte (8bits) which is an index in the tile set. */
-     tm_addr += tile_map_y * 32 + tile_map_x;
-
-     /* Look up the tile map entry in VRAM */
-     tile_index = gb->vram[tm_addr];
-
-     if (gb->gbc) {
-          /* On the GBC we have additional attributes in the 2nd VRAM bank */
-          uint8_t attrs = gb->vram[tm_addr + 0x2000];
-          bool priority = attrs & 0x80;
-          bool y_flip = attrs & 0x40;
-          bool x_flip = attrs & 0x20;
-          bool high_bank = attrs & 0x08;
-          uint8_t palette = attrs & 0x07;
-          enum gb_color col;
-
-          pix.priority = priority;
-
-          if (x_flip) {
-               tile_x = 7 - tile_x;
-          }
+     tm_line += (map_y / 8) * 32;
+
+     for (x = 0; x < n; x += 8, tile_map_x = (tile_map_x + 1) % 32) {
+          /* Offset of the tile map entry in the VRAM */
+          unsigned tm_addr = tm_line + tile_map_x;
+          /* Index of the tile entry in the tile set */
+          uint8_t tile_index = raster->vram[tm_addr];
+          unsigned row_y = tile_y;
+          uint8_t palette = 0;
+          bool prio = false;
+          bool x_flip = false;
+          bool high_bank = false;
+          unsigned tile_addr;
+          uint64_t row;
+
+          if (raster->gbc) {
+               /* On the GBC we have additional attributes in the 2nd VRAM
+                * bank */
+               uint8_t attrs = raster->vram[tm_addr + 0x2000];
+
+               prio = attrs & 0x80;
+               x_flip = attrs & 0x20;
+               high_bank = attrs & 0x08;
+               palette = attrs & 0x07;
+
+               if (attrs & 0x40) {
+                    /* Y flip */
+                    row_y = 7 - row_y;
+               }
 
-          if (y_flip) {
-               tile_y = 7 - tile_y;
+               memset(priority_buf + x, prio, 8);
           }
 
-          col = gb_gpu_get_tile_color(gb, tile_index,
-                                      tile_x, tile_y,
-                                      use_sprite_ts,
-                                      high_bank);
-
-          pix.opaque = col != GB_COL_WHITE;
+          tile_addr = gb_gpu_get_tile_addr(tile_index, use_sprite_ts,
+                                           high_bank);
+          memcpy(&row, gb_gpu_get_tile_row(raster, tile_addr, row_y), 8);
 
-          pix.color.gbc_color = gpu->bg_palettes.colors[palette][col];
-     } else {
-          pix.priority = false;
+          if (x_flip) {
+               row = gb_gpu_flip_row(row);
+          }
 
-          pix.color.dmg_color = gb_gpu_get_tile_color(gb, tile_index,
-                                                      tile_x, tile_y,
-                                                      use_sprite_ts,
-                                                      false);
-          pix.opaque = pix.color.dmg_color != GB_COL_WHITE;
+          /* Add the palette to the color index of the 8 pixels */
+          row |= (palette << 2) * 0x0101010101010101ULL;
 
-          pix.color.dmg_color = gb_gpu_palette_transform(pix.color.dmg_color,
-                                                         gpu->bgp);
+          memcpy(index_buf + x, &row, 8);
      }
 
-     return pix;
-}
-
-static struct gb_gpu_pixel gb_gpu_get_bg_pixel(struct gb *gb,
-                                               unsigned x, unsigned y) {
-     struct gb_gpu *gpu = &gb->gpu;
-     uint8_t bgx = (x + gpu->scx) & 0xff;
-     uint8_t bgy = (y + gpu->scy) & 0xff;
-
-     return gb_gpu_get_bg_win_pixel(gb, bgx, bgy, gpu->bg_use_high_tm);
-}
+     memcpy(index + start, index_buf + first, end - start);
 
-static struct gb_gpu_pixel gb_gpu_get_win_pixel(struct gb *gb,
-                                                unsigned x, unsigned y) {
-     struct gb_gpu *gpu = &gb->gpu;
-     uint8_t wx = x + 7 - gpu->wx;
-     uint8_t wy = y - gpu->wy;
-
-     return gb_gpu_get_bg_win_pixel(gb, wx, wy, gpu->window_use_high_tm);
+     if (raster->gbc) {
+          memcpy(priority + start, priority_buf + first, end - start);
+     }
 }
 
 struct gb_sprite {
@@ -270,30 +394,31 @@ struct gb_sprite {
      uint8_t palette;
 };
 
-static struct gb_sprite gb_get_oam_sprite(struct gb *gb, unsigned index) {
-     struct gb_gpu *gpu = &gb->gpu;
+static struct gb_sprite gb_get_oam_sprite(struct gb_gpu_raster *raster,
+                                          unsigned index) {
+     const uint8_t *oam = raster->oam;
      struct gb_sprite s;
      unsigned oam_off = index * 4;
      uint8_t flags;
 
      /* Y coordinates have an offset of 16 (so that they can clip at the top of
       * the screen) */
-     s.y = (int)gpu->oam[oam_off] - 16;
+     s.y = (int)oam[oam_off] - 16;
 
      /* X coordinates have an offset of 8 (so that they can clip to the left of
       * the screen) */
-     s.x = (int)gpu->oam[oam_off + 1] - 8;
+     s.x = (int)oam[oam_off + 1] - 8;
 
-     s.tile_index = gpu->oam[oam_off + 2];
+     s.tile_index = oam[oam_off + 2];
 
-     flags = gpu->oam[oam_off + 3];
+     flags = oam[oam_off + 3];
 
      s.use_obp1 = flags & 0x10;
      s.x_flip = flags & 0x20;
      s.y_flip = flags & 0x40;
      s.background = flags & 0x80;
 
-     if (gb->gbc) {
+     if (raster->gbc) {
           s.high_bank = flags & 0x08;
           s.palette = flags & 0x07;
      } else {
@@ -304,110 +429,131 @@ static struct gb_sprite gb_get_oam_sprite(struct gb *gb, unsigned index) {
      return s;
 }
 
-/* Max number of sprites per line */
-#define GB_GPU_LINE_SPRITES 10
-
-static void gb_gpu_get_line_sprites(
-     struct gb *gb,
-     unsigned ly,
-     struct gb_sprite sprites[GB_GPU_LINE_SPRITES + 1]) {
-
-     struct gb_gpu *gpu = &gb->gpu;
-     int i;
-     unsigned n_sprites;
-     unsigned sprite_height;
-
-     if (!gpu->sprite_enable) {
-          /* Sprites are disabled, mark the end of the list with an out-of-frame
-           * sprite and bail out */
-          sprites[0].x = GB_LCD_WIDTH * 2;
-          return;
-     }
+/* Rebuild the list of sprites visible on each line from the OAM. The
+ * sprites are stored in OAM order, except on the DMG where they're sorted by
+ * x-coordinate. */
+static void gb_gpu_index_line_sprites(struct gb_gpu_raster *raster,
+                                      bool tall_sprites) {
+     const uint8_t *oam = raster->oam;
+     int sprite_height;
+     unsigned i;
+     unsigned l;
 
-     if (gpu->tall_sprites) {
+     if (tall_sprites) {
           sprite_height = 16;
      } else {
           sprite_height = 8;
      }
 
-     /* Iterate over the OAM and store the sprites that are in the current line.
-      */
-     n_sprites = 0;
-     for (i = 0; i < GB_GPU_MAX_SPRITES; i++) {
-          struct gb_sprite s = gb_get_oam_sprite(gb, i);
+     memset(raster->line_sprite_count, 0, sizeof(raster->line_sprite_count));
 
-          if ((int)ly < s.y || (int)ly >= (s.y + (int)sprite_height)) {
-               /* Sprite isn't on this line */
-               continue;
-          }
+     for (i = 0; i < GB_GPU_MAX_SPRITES; i++) {
+          /* Y coordinates have an offset of 16 */
+          int y = (int)oam[i * 4] - 16;
+          int ly;
+
+          for (ly = y; ly < y + sprite_height && ly < GB_LCD_HEIGHT; ly++) {
+               if (ly < 0 ||
+                   raster->line_sprite_count[ly] >= GB_GPU_LINE_SPRITES) {
+                    /* Off-screen or we reached the maximum number of sprites
+                     * that can be displayed on this line, ignore the rest */
+                    continue;
+               }
 
-          sprites[n_sprites] = s;
-          n_sprites++;
-          if (n_sprites >= GB_GPU_LINE_SPRITES) {
-               /* We reached the maximum number of sprites that can be displayed
-                * on this line, ignore the rest */
-               break;
+               raster->line_sprites[ly][raster->line_sprite_count[ly]++] = i;
           }
      }
 
-     /* Mark the end of the sprite list with an unreachable out-of-frame sprite
-      */
-     sprites[n_sprites].x = GB_LCD_WIDTH * 2;
+     raster->sprites_dirty = false;
+     raster->sprites_tall = tall_sprites;
 
-     if (gb->gbc) {
+     if (raster->gbc) {
           /* In GBC mode the sprite priority is not based on X-coordinates but
            * simply on the index in OAM, so we already have the entries in the
            * array in the right order (from highest priority to lowest) */
           return;
      }
 
-     /* Finally we need to sort the sprites by x-coordinate. Careful: if the
+     /* Otherwise we need to sort the sprites by x-coordinate. Careful: if the
       * sprites have the same x-coordinates the position in OAM gives the
       * priority so we must use a stable sort to maintain the ordering of values
       * with the same x value */
-     for (i = 1; i < n_sprites; i++) {
-          struct gb_sprite cur = sprites[i];
+     for (l = 0; l < GB_LCD_HEIGHT; l++) {
+          uint8_t *sprites = raster->line_sprites[l];
+          int n_sprites = raster->line_sprite_count[l];
+          int k;
           int j;
 
-          /* We move cur back as long as we don't encounter a sprite with
-           * greater-or-equal x value (or we reach the beginning of the list) */
-          for (j = i - 1; j >= 0; j--) {
-               if (sprites[j].x <= cur.x) {
-                    break;
+          for (k = 1; k < n_sprites; k++) {
+               uint8_t cur = sprites[k];
+               uint8_t cur_x = oam[cur * 4 + 1];
+
+               /* We move cur back as long as we don't encounter a sprite with
+                * greater-or-equal x value (or we reach the beginning of the
+                * list) */
+               for (j = k - 1; j >= 0; j--) {
+                    if (oam[sprites[j] * 4 + 1] <= cur_x) {
+                         break;
+                    }
+
+                    sprites[j + 1] = sprites[j];
                }
 
-               sprites[j + 1] = sprites[j];
+               sprites[j + 1] = cur;
           }
+     }
+}
 
-          sprites[j + 1] = cur;
+/* Store the sprites visible on the line in `sprites`, ordered from the
+ * highest priority to the lowest, and return their number */
+static unsigned gb_gpu_get_line_sprites(
+     struct gb_gpu_raster *raster,
+     const struct gb_gpu_line_regs *regs,
+     struct gb_sprite sprites[GB_GPU_LINE_SPRITES]) {
+
+     unsigned n_sprites;
+     unsigned i;
+
+     if (!regs->sprite_enable || regs->ly >= GB_LCD_HEIGHT) {
+          /* Sprites are disabled */
+          return 0;
+     }
+
+     if (raster->sprites_dirty || raster->sprites_tall != regs->tall_sprites) {
+          gb_gpu_index_line_sprites(raster, regs->tall_sprites);
      }
+
+     n_sprites = raster->line_sprite_count[regs->ly];
+
+     for (i = 0; i < n_sprites; i++) {
+          sprites[i] = gb_get_oam_sprite(raster,
+                                         raster->line_sprites[regs->ly][i]);
+     }
+
+     return n_sprites;
 }
 
-/* Attempt to sample the given sprite at the given location on the screen.
- * Returns false if the sprite is not visible at these coordinates, otherwise it
- * updates `p` with the pixel color and returns true. */
-static bool gb_gpu_get_sprite_col(struct gb *gb,
-                                  const struct gb_sprite *sprite,
-                                  unsigned x,
-                                  unsigned y,
-                                  struct gb_gpu_pixel *p) {
-     struct gb_gpu *gpu = &gb->gpu;
-     unsigned sprite_x;
+/* Draw the visible pixels of `sprite` over the line. A sprite pixel is
+ * visible if it's not transparent and it's not hidden by an opaque background
+ * pixel, either because of the sprite's background flag or because of the
+ * background pixel's priority attribute on the GBC. */
+static void gb_gpu_draw_sprite(struct gb_gpu_raster *raster,
+                               const struct gb_gpu_line_regs *regs,
+                               const struct gb_sprite *sprite,
+                               const uint8_t bg_index[GB_LCD_WIDTH],
+                               const uint8_t bg_priority[GB_LCD_WIDTH],
+                               uint8_t index[GB_LCD_WIDTH]) {
      unsigned sprite_y;
      unsigned sprite_flip_height;
      uint8_t tile_index;
-     enum gb_color col;
-
-     if (sprite->background && p->opaque) {
-          /* Sprite is behind the background layer and the background pixel is
-           * opaque so we return the background color directly */
-          return false;
-     }
+     unsigned tile_addr;
+     uint8_t palette;
+     const uint8_t *row;
+     unsigned i;
 
-     sprite_x = (int)x - sprite->x;
-     sprite_y = (int)y - sprite->y;
+     sprite_y = (int)regs->ly - sprite->y;
 
-     if (gpu->tall_sprites) {
+     if (regs->tall_sprites) {
           /* 8x16 sprites use two consecutive tiles. The first tile's index's
            * LSB is always assumed to be 0 */
           tile_index = sprite->tile_index & 0xfe;
@@ -417,129 +563,252 @@ static bool gb_gpu_get_sprite_col(struct gb *gb,
           sprite_flip_height = 7;
      }
 
-     if (sprite->x_flip) {
-          sprite_x = 7 - sprite_x;
-     }
-
      if (sprite->y_flip) {
           sprite_y = sprite_flip_height - sprite_y;
      }
 
-     col = gb_gpu_get_tile_color(gb, tile_index,
-                                 sprite_x, sprite_y,
-                                 true, sprite->high_bank);
+     tile_addr = gb_gpu_get_tile_addr(tile_index, true, sprite->high_bank);
+     /* 8x16 sprites continue in the next tile */
+     tile_addr += (sprite_y / 8) * 16;
+     row = gb_gpu_get_tile_row(raster, tile_addr, sprite_y % 8);
 
-     /* White pixel color (pre-palette) denotes a transparent pixel */
-     if (col == GB_COL_WHITE) {
-          return false;
+     if (raster->gbc) {
+          palette = GB_GPU_LINE_PAL_GBC_SPRITES + sprite->palette;
+     } else if (sprite->use_obp1) {
+          palette = GB_GPU_LINE_PAL_OBP1;
+     } else {
+          palette = GB_GPU_LINE_PAL_OBP0;
      }
 
-     if (gb->gbc) {
-          p->color.gbc_color =
-               gpu->sprite_palettes.colors[sprite->palette][col];
+     for (i = 0; i < 8; i++) {
+          int x = sprite->x + i;
+          enum gb_color col;
+          bool bg_opaque;
+
+          if (x < 0 || x >= GB_LCD_WIDTH) {
+               continue;
+          }
+
+          col = row[sprite->x_flip ? 7 - i : i];
+
+          /* White pixel color (pre-palette) denotes a transparent pixel */
+          if (col == GB_COL_WHITE) {
+               continue;
+          }
+
+          bg_opaque = (bg_index[x] & 3) != GB_COL_WHITE;
+
+          if (bg_opaque && (sprite->background || bg_priority[x])) {
+               /* The background has the priority at this location */
+               continue;
+          }
+
+          index[x] = (palette << 2) | col;
+     }
+}
+
+/* Draw the line described by `regs` with `raster` and send it to the
+ * frontend */
+static void gb_gpu_draw_line(struct gb *gb, struct gb_gpu_raster *raster,
+                             const struct gb_gpu_line_regs *regs) {
+     union gb_gpu_color line[GB_LCD_WIDTH];
+     struct gb_sprite line_sprites[GB_GPU_LINE_SPRITES];
+     unsigned n_sprites;
+     /* Index of the background and window pixels in the line palette table */
+     uint8_t bg_index[GB_LCD_WIDTH];
+     /* GBC-only: true if the background pixel has priority over the
+      * sprites */
+     uint8_t bg_priority[GB_LCD_WIDTH];
+     /* Index of each pixel in the line palette table */
+     uint8_t line_index[GB_LCD_WIDTH];
+     /* First column covered by the window */
+     unsigned win_start = GB_LCD_WIDTH;
+     unsigned i;
+
+     if (regs->blank) {
+          for (i = 0; i < GB_LCD_WIDTH; i++) {
+               line[i].dmg_color = GB_COL_WHITE;
+          }
+
+          gb->frontend.draw_line_dmg(gb, regs->ly, line);
+          return;
+     }
+
+     if (regs->window_enable && regs->ly >= regs->wy) {
+          int wx = (int)regs->wx - 7;
+
+          if (wx < 0) {
+               win_start = 0;
+          } else if (wx < GB_LCD_WIDTH) {
+               win_start = wx;
+          }
+     }
+
+     if (regs->bg_enable) {
+          gb_gpu_draw_bg_win(raster, regs, bg_index, bg_priority, 0, win_start,
+                             regs->scx, regs->ly + regs->scy,
+                             regs->bg_use_high_tm);
      } else {
-          uint8_t palette;
+          uint8_t blank;
 
-          if (sprite->use_obp1) {
-               palette = gpu->obp1;
+          if (raster->gbc) {
+               blank = GB_GPU_LINE_PAL_GBC_BLANK << 2;
           } else {
-               palette = gpu->obp0;
+               blank = GB_GPU_LINE_PAL_DMG_BLANK << 2;
           }
 
-          p->color.dmg_color = gb_gpu_palette_transform(col, palette);
+          memset(bg_index, blank, win_start);
+          memset(bg_priority, 0, win_start);
+     }
+
+     if (win_start < GB_LCD_WIDTH) {
+          gb_gpu_draw_bg_win(raster, regs, bg_index, bg_priority,
+                             win_start, GB_LCD_WIDTH,
+                             win_start + 7 - regs->wx, regs->ly - regs->wy,
+                             regs->window_use_high_tm);
      }
 
-     return true;
+     if (!raster->gbc) {
+          /* No priority attribute on the DMG */
+          memset(bg_priority, 0, GB_LCD_WIDTH);
+     }
+
+     memcpy(line_index, bg_index, GB_LCD_WIDTH);
+
+     /* Draw the sprites from the lowest priority to the highest so that each
+      * pixel ends up with the first visible sprite in priority order */
+     n_sprites = gb_gpu_get_line_sprites(raster, regs, line_sprites);
+     for (i = n_sprites; i > 0; i--) {
+          gb_gpu_draw_sprite(raster, regs, &line_sprites[i - 1],
+                             bg_index, bg_priority, line_index);
+     }
+
+     if (raster->gbc && gb->frontend.draw_line_xrgb8888) {
+          uint32_t colors[(GB_GPU_LINE_PAL_GBC_BLANK + 1) * 4];
+          uint32_t pixels[GB_LCD_WIDTH];
+
+          memcpy(colors, regs->bg_host_colors, sizeof(regs->bg_host_colors));
+          memcpy(colors + GB_GPU_LINE_PAL_GBC_SPRITES * 4,
+                 regs->sprite_host_colors, sizeof(regs->sprite_host_colors));
+          for (i = 0; i < 4; i++) {
+               colors[GB_GPU_LINE_PAL_GBC_BLANK * 4 + i] =
+                    gb_pixel_gbc_color_to_xrgb8888(0);
+          }
+
+          gb_pixel_map_xrgb8888(line_index, colors, pixels, GB_LCD_WIDTH);
+          gb->frontend.draw_line_xrgb8888(gb, regs->ly, pixels);
+     } else if (raster->gbc) {
+          /* One padding entry for gb_pixel_map_gbc */
+          uint16_t colors[(GB_GPU_LINE_PAL_GBC_BLANK + 1) * 4 + 1] = { 0 };
+
+          memcpy(colors, regs->bg_colors, sizeof(regs->bg_colors));
+          memcpy(colors + GB_GPU_LINE_PAL_GBC_SPRITES * 4,
+                 regs->sprite_colors, sizeof(regs->sprite_colors));
+
+          gb_pixel_map_gbc(line_index, colors, line, GB_LCD_WIDTH);
+          gb->frontend.draw_line_gbc(gb, regs->ly, line);
+     } else {
+          uint8_t shades[16];
+
+          for (i = 0; i < 4; i++) {
+               shades[i] = gb_gpu_palette_transform(i, regs->bgp);
+               shades[GB_GPU_LINE_PAL_OBP0 * 4 + i] =
+                    gb_gpu_palette_transform(i, regs->obp0);
+               shades[GB_GPU_LINE_PAL_OBP1 * 4 + i] =
+                    gb_gpu_palette_transform(i, regs->obp1);
+               shades[GB_GPU_LINE_PAL_DMG_BLANK * 4 + i] = GB_COL_WHITE;
+          }
+
+          gb_pixel_map_dmg(line_index, shades, line, GB_LCD_WIDTH);
+          gb->frontend.draw_line_dmg(gb, regs->ly, line);
+     }
 }
 
-/* Returns true if the given screen coordinates lie within the window */
-static bool gb_gpu_pix_in_window(struct gb *gb, unsigned x, unsigned y) {
+/* Draw line `regs->ly` inline or record it for the render thread */
+static void gb_gpu_emit_line(struct gb *gb,
+                             const struct gb_gpu_line_regs *regs) {
      struct gb_gpu *gpu = &gb->gpu;
-     int wx = (int)gpu->wx - 7;
+     struct gb_gpu_render_thread *rt = gpu->render_thread;
+     struct gb_gpu_frame *frame;
 
-     return (int)x >= wx && y >= gpu->wy;
+     if (rt == NULL) {
+          gb_gpu_draw_line(gb, &gpu->raster, regs);
+          return;
+     }
+
+     frame = gb_gpu_record_frame(rt);
+
+     if (frame->n_lines >= GB_GPU_FRAME_LINES) {
+          gb_gpu_submit_frame(rt, false);
+          frame = gb_gpu_record_frame(rt);
+     }
+
+     frame->lines[frame->n_lines] = *regs;
+     frame->line_writes[frame->n_lines] = frame->n_writes;
+     frame->n_lines++;
 }
 
 static void gb_gpu_draw_cur_line(struct gb *gb) {
      struct gb_gpu *gpu = &gb->gpu;
-     union gb_gpu_color line[GB_LCD_WIDTH];
-     /* We force a "dummy" out-of-frame sprite at the end to avoid checking for
-      * bounds while we draw the line */
-     struct gb_sprite line_sprites[GB_GPU_LINE_SPRITES + 1];
-     unsigned x;
-     unsigned next_sprite = 0;
-
-     gb_gpu_get_line_sprites(gb, gpu->ly, line_sprites);
-
-     for (x = 0; x < GB_LCD_WIDTH; x++) {
-          struct gb_gpu_pixel p = {
-               .color.dmg_color = GB_COL_WHITE,
-               .opaque = false,
-               .priority = false,
-          };
-          struct gb_sprite s;
-          unsigned i;
-
-          if (gpu->window_enable && gb_gpu_pix_in_window(gb, x, gpu->ly)) {
-               /* Pixel lies within the window */
-               p = gb_gpu_get_win_pixel(gb, x, gpu->ly);
-          } else if (gpu->bg_enable) {
-               p = gb_gpu_get_bg_pixel(gb, x, gpu->ly);
-          }
+     struct gb_gpu_line_regs regs;
 
-          /* If the background priority is set it means that the BG has the
-           * priority over any sprite at this location */
-          if (!p.priority || !p.opaque) {
-               if (gb->gbc) {
-                    /* In GBC the sprites aren't ordered by x-coordinate because
-                     * the location in OAM has priority, so we have to iterate
-                     * through the entire list until we find a visible sprite or
-                     * we reach the end (signaled by a x value of
-                     * GB_LCD_WIDTH * 2, see gb_gb_get_line_sprites) */
-                    for (i = 0; line_sprites[i].x < GB_LCD_WIDTH * 2; i++) {
-                         s = line_sprites[i];
-
-                         if ((int)x < s.x || (int)x >= s.x + 8) {
-                              /* Sprite is not visible at this location */
-                              continue;
-                         }
-
-                         if (gb_gpu_get_sprite_col(gb, &s, x, gpu->ly, &p)) {
-                              break;
-                         }
-                    }
-               } else {
-                    /* Figure out what is the next sprite we must display */
-                    while (next_sprite < GB_GPU_LINE_SPRITES) {
-                         if (line_sprites[next_sprite].x + 8 <= x ) {
-                              /* We're done displaying this sprite */
-                              next_sprite++;
-                         } else {
-                              /* We have not passed this sprite yet */
-                              break;
-                         }
-                    }
+     if (gpu->skip_frame) {
+          return;
+     }
 
-                    /* Iterate on all sprites at this position until we find one
-                     * that's visible or we run out */
-                    for (i = next_sprite; line_sprites[i].x <= (int)x; i++) {
-                         s = line_sprites[i];
+     regs.ly = gpu->ly;
+     regs.blank = false;
+     regs.scx = gpu->scx;
+     regs.scy = gpu->scy;
+     regs.wx = gpu->wx;
+     regs.wy = gpu->wy;
+     regs.bgp = gpu->bgp;
+     regs.obp0 = gpu->obp0;
+     regs.obp1 = gpu->obp1;
+     regs.bg_enable = gpu->bg_enable;
+     regs.window_enable = gpu->window_enable;
+     regs.sprite_enable = gpu->sprite_enable;
+     regs.tall_sprites = gpu->tall_sprites;
+     regs.bg_use_high_tm = gpu->bg_use_high_tm;
+     regs.window_use_high_tm = gpu->window_use_high_tm;
+     regs.bg_window_use_sprite_ts = gpu->bg_window_use_sprite_ts;
+
+     if (gb->gbc && gb->frontend.draw_line_xrgb8888) {
+          memcpy(regs.bg_host_colors, gpu->bg_palettes.host_colors,
+                 sizeof(regs.bg_host_colors));
+          memcpy(regs.sprite_host_colors, gpu->sprite_palettes.host_colors,
+                 sizeof(regs.sprite_host_colors));
+     } else if (gb->gbc) {
+          memcpy(regs.bg_colors, gpu->bg_palettes.colors,
+                 sizeof(regs.bg_colors));
+          memcpy(regs.sprite_colors, gpu->sprite_palettes.colors,
+                 sizeof(regs.sprite_colors));
+     }
 
-                         if (gb_gpu_get_sprite_col(gb, &s, x, gpu->ly, &p)) {
-                              break;
-                         }
-                    }
-               }
-          }
+     gb_gpu_emit_line(gb, &regs);
+}
 
-          line[x] = p.color;
+/* We're done with the current frame, display it unless it's skipped and
+ * decide whether the next one will be */
+static void gb_gpu_flip(struct gb *gb) {
+     struct gb_gpu *gpu = &gb->gpu;
+
+     if (!gpu->skip_frame) {
+          if (gpu->render_thread) {
+               gb_gpu_submit_frame(gpu->render_thread, true);
+          } else {
+               gb->frontend.flip(gb);
+          }
      }
 
-     if (gb->gbc) {
-          gb->frontend.draw_line_gbc(gb, gpu->ly, line);
-     } else {
-          gb->frontend.draw_line_dmg(gb, gpu->ly, line);
+     if (gpu->skip_period == 0) {
+          gpu->skip_count = 0;
+          gpu->skip_frame = false;
+          return;
      }
+
+     gpu->skip_count = (gpu->skip_count + 1) % gpu->skip_period;
+     gpu->skip_frame = gpu->skip_count < gpu->skip_frames;
 }
 
 void gb_gpu_sync(struct gb *gb) {
@@ -604,7 +873,7 @@ void gb_gpu_sync(struct gb *gb) {
 
                if (gpu->ly == VSYNC_START) {
                     /* We're done drawing the current frame */
-                    gb->frontend.flip(gb);
+                    gb_gpu_flip(gb);
                     gb_irq_trigger(gb, GB_IRQ_VSYNC);
 
                     if (gpu->iten_mode1) {
@@ -705,16 +974,15 @@ void gb_gpu_set_lcdc(struct gb *gb, uint8_t lcdc) {
           gpu->master_enable = master_enable;
 
           if (master_enable == false) {
-               union gb_gpu_color line[GB_LCD_WIDTH];
+               struct gb_gpu_line_regs regs;
                unsigned i;
 
                /* Clear the screen */
-               for (i = 0; i < GB_LCD_WIDTH; i++) {
-                    line[i].dmg_color = GB_COL_WHITE;
-               }
+               regs.blank = true;
 
                for (i = 0; i < GB_LCD_HEIGHT; i++) {
-                    gb->frontend.draw_line_dmg(gb, i, line);
+                    regs.ly = i;
+                    gb_gpu_emit_line(gb, &regs);
                }
 
                gpu->ly = 0;
@@ -749,3 +1017,134 @@ uint8_t gb_gpu_get_ly(struct gb *gb) {
 
      return gpu->ly;
 }
+
+/* Apply the recorded writes from `first` to `end` (excluded) to the render
+ * thread's copy of the VRAM and OAM */
+static void gb_gpu_replay_writes(struct gb_gpu_render_thread *rt,
+                                 const struct gb_gpu_frame *frame,
+                                 unsigned first, unsigned end) {
+     unsigned i;
+
+     for (i = first; i < end; i++) {
+          const struct gb_gpu_write *w = &frame->writes[i];
+
+          if (w->off & GB_GPU_WRITE_OAM) {
+               rt->oam[w->off & ~GB_GPU_WRITE_OAM] = w->val;
+               rt->raster.sprites_dirty = true;
+          } else {
+               rt->vram[w->off] = w->val;
+               gb_gpu_raster_vram_written(&rt->raster, w->off);
+          }
+     }
+}
+
+static void *gb_gpu_render_thread_run(void *data) {
+     struct gb *gb = data;
+     struct gb_gpu_render_thread *rt = gb->gpu.render_thread;
+     unsigned index;
+
+     for (index = 0;; index = (index + 1) % GB_GPU_RENDER_FRAMES) {
+          struct gb_gpu_frame *frame = &rt->frames[index];
+          unsigned replayed = 0;
+          unsigned l;
+
+          sem_wait(&frame->ready);
+
+          if (frame->quit) {
+               return NULL;
+          }
+
+          for (l = 0; l < frame->n_lines; l++) {
+               gb_gpu_replay_writes(rt, frame, replayed, frame->line_writes[l]);
+               replayed = frame->line_writes[l];
+
+               gb_gpu_draw_line(gb, &rt->raster, &frame->lines[l]);
+          }
+
+          gb_gpu_replay_writes(rt, frame, replayed, frame->n_writes);
+
+          if (frame->flip) {
+               gb->frontend.flip(gb);
+          }
+
+          sem_post(&frame->free);
+     }
+}
+
+/* Move the rasterization to a dedicated thread. From then on the frontend's
+ * draw_line and flip callbacks are called from that thread, up to
+ * GB_GPU_RENDER_FRAMES frames behind the emulation. Must be called after
+ * gb_gpu_reset. */
+void gb_gpu_start_render_thread(struct gb *gb) {
+     struct gb_gpu *gpu = &gb->gpu;
+     struct gb_gpu_render_thread *rt;
+     unsigned i;
+
+     if (gpu->render_thread) {
+          return;
+     }
+
+     rt = calloc(1, sizeof(*rt));
+     if (rt == NULL) {
+          perror("calloc failed");
+          die();
+     }
+
+     memcpy(rt->vram, gb->vram, sizeof(rt->vram));
+     memcpy(rt->oam, gpu->oam, sizeof(rt->oam));
+     gb_gpu_raster_reset(gb, &rt->raster, rt->vram, rt->oam);
+
+     for (i = 0; i < GB_GPU_RENDER_FRAMES; i++) {
+          if (sem_init(&rt->frames[i].free, 0, 1) ||
+              sem_init(&rt->frames[i].ready, 0, 0)) {
+               perror("sem_init failed");
+               die();
+          }
+     }
+
+     rt->record_index = 0;
+     rt->recording = false;
+
+     gpu->render_thread = rt;
+
+     if (pthread_create(&rt->thread, NULL, gb_gpu_render_thread_run, gb)) {
+          perror("pthread_create failed");
+          die();
+     }
+}
+
+/* Draw the lines recorded so far, stop the render thread and go back to
+ * drawing the lines inline */
+void gb_gpu_stop_render_thread(struct gb *gb) {
+     struct gb_gpu *gpu = &gb->gpu;
+     struct gb_gpu_render_thread *rt = gpu->render_thread;
+     struct gb_gpu_frame *frame;
+     unsigned i;
+
+     if (rt == NULL) {
+          return;
+     }
+
+     frame = gb_gpu_record_frame(rt);
+     if (frame->n_lines > 0 || frame->n_writes > 0) {
+          gb_gpu_submit_frame(rt, false);
+          frame = gb_gpu_record_frame(rt);
+     }
+
+     frame->quit = true;
+     sem_post(&frame->ready);
+
+     pthread_join(rt->thread, NULL);
+
+     for (i = 0; i < GB_GPU_RENDER_FRAMES; i++) {
+          sem_destroy(&rt->frames[i].free);
+          sem_destroy(&rt->frames[i].ready);
+     }
+
+     free(rt);
+     gpu->render_thread = NULL;
+
+     /* The VRAM may have been modified while the tile cache wasn't
+      * tracking it */
+     gb_gpu_raster_reset(gb, &gpu->raster, gb->vram, gpu->oam);
+}
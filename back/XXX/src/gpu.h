@@ -3,6 +3,12 @@
 
 /* The GPU supports up to 40 sprites concurrently */
 #define GB_GPU_MAX_SPRITES 40
+/* Max number of sprites per line */
+#define GB_GPU_LINE_SPRITES 10
+
+/* Each VRAM bank holds 384 tiles of 8x8 pixels in its first 6KiB */
+#define GB_GPU_BANK_TILES 384
+#define GB_GPU_CACHE_TILES (GB_GPU_BANK_TILES * 2)
 
 enum gb_color {
      GB_COL_WHITE,
@@ -25,12 +31,119 @@ union gb_gpu_color {
 struct gb_color_palette {
      /* 8 palettes of 4 colors. Each color is stored as xBGR 1555 */
      uint16_t colors[8][4];
+     /* Same colors converted to host xRGB 8888 when they're written */
+     uint32_t host_colors[8][4];
      /* Index of the next write in this palette */
      uint8_t write_index;
      /* If true `write_index` auto-increments after a write */
      bool auto_increment;
 };
 
+/* Registers used by the rasterizer to draw one line */
+struct gb_gpu_line_regs {
+     /* Line being drawn */
+     uint8_t ly;
+     /* If true the line is blanked because the LCD has been turned off, all
+      * the other fields are ignored */
+     bool blank;
+     uint8_t scx;
+     uint8_t scy;
+     uint8_t wx;
+     uint8_t wy;
+     uint8_t bgp;
+     uint8_t obp0;
+     uint8_t obp1;
+     bool bg_enable;
+     bool window_enable;
+     bool sprite_enable;
+     bool tall_sprites;
+     bool bg_use_high_tm;
+     bool window_use_high_tm;
+     bool bg_window_use_sprite_ts;
+     /* GBC-only: background and sprite palette colors. If the frontend
+      * takes host pixels only the host colors are set. */
+     uint16_t bg_colors[8][4];
+     uint16_t sprite_colors[8][4];
+     uint32_t bg_host_colors[8][4];
+     uint32_t sprite_host_colors[8][4];
+};
+
+/* Memory used by the rasterizer */
+struct gb_gpu_raster {
+     /* True if we're drawing GBC lines */
+     bool gbc;
+     /* VRAM (both banks) and OAM contents */
+     const uint8_t *vram;
+     const uint8_t *oam;
+     /* Decoded tile cache for both VRAM banks: one color index per pixel */
+     uint8_t tiles[GB_GPU_CACHE_TILES][8][8];
+     /* True if the tile has been modified since it was last decoded */
+     bool tile_dirty[GB_GPU_CACHE_TILES];
+     /* OAM index of the sprites visible on each line, ordered from the
+      * highest priority to the lowest */
+     uint8_t line_sprites[GB_LCD_HEIGHT][GB_GPU_LINE_SPRITES];
+     uint8_t line_sprite_count[GB_LCD_HEIGHT];
+     /* True if the OAM has been modified since `line_sprites` was built */
+     bool sprites_dirty;
+     /* Sprite height `line_sprites` was built for */
+     bool sprites_tall;
+};
+
+/* Number of lines recorded in a render thread frame. The LCD can be turned
+ * off and back on in the middle of a frame so we leave some margin, a frame
+ * is submitted early if it fills up. */
+#define GB_GPU_FRAME_LINES (GB_LCD_HEIGHT * 2)
+/* Number of VRAM and OAM writes recorded in a render thread frame */
+#define GB_GPU_FRAME_WRITES 0x4000
+/* Flag set in the offset of the writes targeting the OAM */
+#define GB_GPU_WRITE_OAM 0x8000U
+
+/* VRAM or OAM write recorded for the render thread */
+struct gb_gpu_write {
+     /* Offset in the VRAM (including the bank offset), or offset in the OAM
+      * with GB_GPU_WRITE_OAM set */
+     uint16_t off;
+     uint8_t val;
+};
+
+/* One frame recorded by the emulation thread for the render thread: the
+ * registers of each line and the VRAM and OAM writes made in between */
+struct gb_gpu_frame {
+     struct gb_gpu_line_regs lines[GB_GPU_FRAME_LINES];
+     /* Number of writes to apply before drawing each line */
+     unsigned line_writes[GB_GPU_FRAME_LINES];
+     unsigned n_lines;
+     struct gb_gpu_write writes[GB_GPU_FRAME_WRITES];
+     unsigned n_writes;
+     /* True if the frame must be displayed once drawn */
+     bool flip;
+     /* True if the render thread must exit */
+     bool quit;
+     /* Posted by the render thread once the frame has been drawn */
+     sem_t free;
+     /* Posted by the emulation thread once the frame has been recorded */
+     sem_t ready;
+};
+
+/* Number of frames in flight between the emulation and render threads */
+#define GB_GPU_RENDER_FRAMES 2
+
+/* Rasterizer running in its own thread: the emulation thread only records
+ * the state of each line and the render thread draws it and calls the
+ * frontend's draw_line and flip callbacks */
+struct gb_gpu_render_thread {
+     pthread_t thread;
+     struct gb_gpu_frame frames[GB_GPU_RENDER_FRAMES];
+     /* Frame currently recorded by the emulation thread */
+     unsigned record_index;
+     /* True if the emulation thread owns the frame at `record_index` */
+     bool recording;
+     /* Copy of the VRAM and OAM owned by the render thread */
+     uint8_t vram[0x4000];
+     uint8_t oam[GB_GPU_MAX_SPRITES * 4];
+     struct gb_gpu_raster raster;
+};
+
 struct gb_gpu {
      /* Background scroll X */
      uint8_t scx;
@@ -83,6 +196,20 @@ struct gb_gpu {
      struct gb_color_palette bg_palettes;
      /* GBC-only: sprite color palettes */
      struct gb_color_palette sprite_palettes;
+     /* Rasterizer drawing the lines inline, from the emulated VRAM and OAM */
+     struct gb_gpu_raster raster;
+     /* Render thread, NULL if the lines are drawn inline */
+     struct gb_gpu_render_thread *render_thread;
+     /* Frame skipping, set by the frontend: the first `skip_frames` frames of
+      * every `skip_period` frames are neither drawn nor flipped. The timings,
+      * interrupts and HDMA transfers are unaffected. Disabled if
+      * `skip_period` is 0, changes take effect at the next frame. */
+     unsigned skip_frames;
+     unsigned skip_period;
+     /* Position of the current frame in the skip period */
+     unsigned skip_count;
+     /* True if the current frame is skipped */
+     bool skip_frame;
 };
 
 void gb_gpu_reset(struct gb *gb);
@@ -92,5 +219,9 @@ void gb_gpu_set_lcdc(struct gb *gb, uint8_t stat);
 uint8_t gb_gpu_get_lcdc(struct gb *gb);
 uint8_t gb_gpu_get_ly(struct gb *gb);
 uint8_t gb_gpu_get_lcd_stat(struct gb *gb);
+void gb_gpu_vram_written(struct gb *gb, uint16_t off);
+void gb_gpu_oam_written(struct gb *gb, uint16_t off);
+void gb_gpu_start_render_thread(struct gb *gb);
+void gb_gpu_stop_render_thread(struct gb *gb);
 
 #endif /* _GB_GPU_H_ */
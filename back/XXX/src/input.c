@@ -65,16 +65,7 @@ uint8_t gb_input_get_state(struct gb *gb) {
 }
 
 uint8_t *InputGetState(struct gb *gb) {
-     struct gb_input *input = &gb->input;
-     static uint8_t v = 0xff;
-
-     if (input->dpad_selected) {
-          v &= input->dpad_state;
-     }
-
-     if (input->buttons_selected) {
-          v &= input->buttons_state;
-     }
+     gb->read_latch = gb_input_get_state(gb);
 
-     return &v;
+     return &gb->read_latch;
 }
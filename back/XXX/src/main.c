@@ -17,12 +17,6 @@ int main(int argc, char **argv) {
     }
     gb->cpu.memory = gb;
 
-    for (size_t i = 0; i < GB_SPU_SAMPLE_BUFFER_COUNT; i++) {
-         struct gb_spu_sample_buffer *buf = &gb->spu.buffers[i];
-         memset(buf->samples, 0, sizeof(buf->samples));
-         sem_init(&buf->free, 0, 0);
-         sem_init(&buf->ready, 0, 1);
-    }
     gb_sdl_frontend_init(gb);
 
     const char *rom_file = argv[1];
@@ -35,20 +29,13 @@ int main(int argc, char **argv) {
     gb_dma_reset(gb);
     gb_timer_reset(gb);
     gb_spu_reset(gb);
+    gb_memory_reset(gb);
 
-    gb->iram_high_bank = 1;
-    gb->vram_high_bank = false;
     gb->quit = false;
     gb->double_speed = false;
     gb->speed_switch_pending = false;
 
-    while (!gb->quit) {
-         gb->frontend.refresh_input(gb);
-
-         /* We refresh the input at 120Hz. This is a trade-off, if we refresh
-          * faster we'll reduce latency at the cost of performance. */
-         gb_cpu_run_cycles(gb, GB_CPU_FREQ_HZ / 120);
-    }
+    gb_sdl_run(gb);
 
     gb->frontend.destroy(gb);
     gb_cart_unload(gb);
@@ -1,4 +1,5 @@
 #include <stdio.h>
+#include <string.h>
 #include "gb.h"
 
 /* ROM (bank 0 + 1) */
@@ -190,9 +191,8 @@ uint8_t *MemoryRead1(struct gb *gb, uint16_t addr) {
      if (addr == REG_DIV) {
           gb_timer_sync(gb);
           /* Return the high 8 bits of the divider counter */
-        static uint8_t tmp;
-            tmp = gb->timer.divider_counter >> 8;
-          return &tmp;
+            gb->read_latch = gb->timer.divider_counter >> 8;
+          return &gb->read_latch;
      }
 
      if (addr == REG_TIMA) {
@@ -205,9 +205,8 @@ uint8_t *MemoryRead1(struct gb *gb, uint16_t addr) {
      }
 
      if (addr == REG_TAC) {
-        static uint8_t tmp;
-        tmp = gb_timer_get_config(gb);
-        return &tmp;
+        gb->read_latch = gb_timer_get_config(gb);
+        return &gb->read_latch;
      }
 
      if (addr == REG_IF) {
@@ -215,25 +214,22 @@ uint8_t *MemoryRead1(struct gb *gb, uint16_t addr) {
      }
 
      if (addr == REG_NR10) {
-          static uint8_t r = 0x80;
+          gb->read_latch = 0x80;
+          gb->read_latch |= gb->spu.nr1.sweep.shift;
+          gb->read_latch |= gb->spu.nr1.sweep.subtract << 3;
+          gb->read_latch |= gb->spu.nr1.sweep.time << 4;
 
-          r |= gb->spu.nr1.sweep.shift;
-          r |= gb->spu.nr1.sweep.subtract << 3;
-          r |= gb->spu.nr1.sweep.time << 4;
-
-          return &r;
+          return &gb->read_latch;
      }
 
      if (addr == REG_NR11) {
-        static uint8_t tmp;
-        tmp = (gb->spu.nr1.wave.duty_cycle << 6) | 0x3f;
-          return &tmp;
+        gb->read_latch = (gb->spu.nr1.wave.duty_cycle << 6) | 0x3f;
+          return &gb->read_latch;
      }
 
      if (addr == REG_NR12) {
-        static uint8_t tmp;
-        tmp = gb->spu.nr1.envelope_config;
-        return &tmp;
+        gb->read_latch = gb->spu.nr1.envelope_config;
+        return &gb->read_latch;
      }
 
      if (addr == REG_NR13) {
@@ -242,21 +238,18 @@ uint8_t *MemoryRead1(struct gb *gb, uint16_t addr) {
      }
 
      if (addr == REG_NR14) {
-        static uint8_t tmp;
-          tmp = (gb->spu.nr1.duration.enable << 6) | 0xbf;
-        return &tmp;
+          gb->read_latch = (gb->spu.nr1.duration.enable << 6) | 0xbf;
+        return &gb->read_latch;
      }
 
      if (addr == REG_NR21) {
-        static uint8_t tmp;
-          tmp = (gb->spu.nr2.wave.duty_cycle << 6) | 0x3f;
-        return &tmp;
+          gb->read_latch = (gb->spu.nr2.wave.duty_cycle << 6) | 0x3f;
+        return &gb->read_latch;
      }
 
      if (addr == REG_NR22) {
-        static uint8_t tmp;
-          tmp = gb->spu.nr2.envelope_config;
-        return &tmp;
+          gb->read_latch = gb->spu.nr2.envelope_config;
+        return &gb->read_latch;
      }
 
      if (addr == REG_NR23) {
@@ -266,16 +259,14 @@ uint8_t *MemoryRead1(struct gb *gb, uint16_t addr) {
      }
 
      if (addr == REG_NR24) {
-        static uint8_t tmp;
-          tmp =  (gb->spu.nr2.duration.enable << 6) | 0xbf;
-        return &tmp;
+          gb->read_latch =  (gb->spu.nr2.duration.enable << 6) | 0xbf;
+        return &gb->read_latch;
      }
 
      if (addr == REG_NR30) {
           gb_spu_sync(gb);
-        static uint8_t tmp;
-          tmp = (gb->spu.nr3.enable << 7) | 0x7f;
-        return &tmp;
+          gb->read_latch = (gb->spu.nr3.enable << 7) | 0x7f;
+        return &gb->read_latch;
      }
 
      if (addr == REG_NR31) {
@@ -283,9 +274,8 @@ uint8_t *MemoryRead1(struct gb *gb, uint16_t addr) {
      }
 
      if (addr == REG_NR32) {
-        static uint8_t tmp;
-          tmp = (gb->spu.nr3.volume_shift << 5) | 0x9f;
-        return &tmp;
+          gb->read_latch = (gb->spu.nr3.volume_shift << 5) | 0x9f;
+        return &gb->read_latch;
      }
 
      if (addr == REG_NR33) {
@@ -294,9 +284,8 @@ uint8_t *MemoryRead1(struct gb *gb, uint16_t addr) {
      }
 
      if (addr == REG_NR34) {
-        static uint8_t tmp;
-        tmp = (gb->spu.nr3.duration.enable << 6) | 0xbf;
-        return &tmp;
+        gb->read_latch = (gb->spu.nr3.duration.enable << 6) | 0xbf;
+        return &gb->read_latch;
      }
 
      if (addr == REG_NR41) {
@@ -313,9 +302,8 @@ uint8_t *MemoryRead1(struct gb *gb, uint16_t addr) {
      }
 
      if (addr == REG_NR44) {
-        static uint8_t tmp;
-          tmp =  (gb->spu.nr4.duration.enable << 6) | 0xbf;
-        return &tmp;
+          gb->read_latch =  (gb->spu.nr4.duration.enable << 6) | 0xbf;
+        return &gb->read_latch;
      }
 
      if (addr == REG_NR50) {
@@ -327,14 +315,12 @@ uint8_t *MemoryRead1(struct gb *gb, uint16_t addr) {
      }
 
      if (addr == REG_NR52) {
-          static uint8_t r = 0;
-        r = 0;
-
-          r |= gb->spu.nr2.running << 1;
-          r |= gb->spu.nr3.running << 2;
-          r |= gb->spu.enable << 7;
+          gb->read_latch = 0;
+          gb->read_latch |= gb->spu.nr2.running << 1;
+          gb->read_latch |= gb->spu.nr3.running << 2;
+          gb->read_latch |= gb->spu.enable << 7;
 
-          return &r;
+          return &gb->read_latch;
      }
 
      if (addr >= NR3_RAM_BASE && addr < NR3_RAM_END) {
@@ -342,15 +328,13 @@ uint8_t *MemoryRead1(struct gb *gb, uint16_t addr) {
      }
 
      if (addr == REG_LCDC) {
-        static uint8_t tmp;
-          tmp = gb_gpu_get_lcdc(gb);
-        return &tmp;
+          gb->read_latch = gb_gpu_get_lcdc(gb);
+        return &gb->read_latch;
      }
 
      if (addr == REG_LCD_STAT) {
-        static uint8_t tmp;
-          tmp = gb_gpu_get_lcd_stat(gb);
-        return &tmp;
+          gb->read_latch = gb_gpu_get_lcd_stat(gb);
+        return &gb->read_latch;
      }
 
      if (addr == REG_SCY) {
@@ -362,9 +346,8 @@ uint8_t *MemoryRead1(struct gb *gb, uint16_t addr) {
      }
 
      if (addr == REG_LY) {
-        static uint8_t tmp;
-          tmp = gb_gpu_get_ly(gb);
-        return &tmp;
+          gb->read_latch = gb_gpu_get_ly(gb);
+        return &gb->read_latch;
      }
 
      if (addr == REG_LYC) {
@@ -507,6 +490,13 @@ uint8_t *MemoryRead1(struct gb *gb, uint16_t addr) {
 
 /* Read one byte from memory at `addr` */
 uint8_t gb_memory_readb(struct gb *gb, uint16_t addr) {
+     const uint8_t *page = gb->read_map[addr >> 8];
+
+     if (page != NULL) {
+          /* Plain memory, no side effect */
+          return page[addr & 0xff];
+     }
+
      if (addr >= ROM_BASE && addr < ROM_END) {
           return gb_cart_rom_readb(gb, addr - ROM_BASE);
      }
@@ -842,14 +832,136 @@ uint8_t gb_memory_readb(struct gb *gb, uint16_t addr) {
      return 0xff;
 }
 
+/* Invalidate the cached blocks if `off` (offset in the internal RAM followed
+ * by the zero page RAM) contains code */
+static void gb_memory_ram_code_check(struct gb *gb, uint16_t off) {
+     if (gb->cpu.ram_code_pages[off >> GB_CPU_CODE_PAGE_SHIFT]) {
+          gb_cpu_invalidate_ram_code(gb);
+     }
+}
+
+/* Returns true if the 256-byte page at `off` in the internal/zero-page RAM
+ * contains cached code, in which case the writes must go through the slow
+ * path to invalidate it */
+static bool gb_memory_page_has_code(struct gb *gb, uint16_t off) {
+     unsigned first = off >> GB_CPU_CODE_PAGE_SHIFT;
+
+     for (unsigned p = first; p < first + (0x100 >> GB_CPU_CODE_PAGE_SHIFT);
+          p++) {
+          if (gb->cpu.ram_code_pages[p]) {
+               return true;
+          }
+     }
+
+     return false;
+}
+
+/* Update the page tables for the cartridge ROM. Must be called every time
+ * the ROM bank changes. Writes always go to the MBC so only reads are
+ * direct. */
+void gb_memory_map_rom(struct gb *gb) {
+     const uint8_t *bank = gb->cart.rom + gb_cart_rom_offset(gb, 0x4000);
+
+     if (gb->read_map[0x40] == bank) {
+          /* Same bank as before */
+          return;
+     }
+
+     for (unsigned page = 0; page < 0x40; page++) {
+          gb->read_map[(ROM_BASE >> 8) + page] = gb->cart.rom + (page << 8);
+          gb->read_map[(ROM_BASE >> 8) + 0x40 + page] = bank + (page << 8);
+     }
+}
+
+/* Update the page tables for the cartridge RAM. Must be called every time
+ * the RAM bank or the banking mode changes. Writes need to update the save
+ * file so only reads are direct. */
+void gb_memory_map_cram(struct gb *gb) {
+     for (unsigned page = 0; page < 0x20; page++) {
+          int off = gb_cart_ram_offset(gb, page << 8);
+
+          gb->read_map[(CRAM_BASE >> 8) + page] =
+               (off >= 0) ? gb->cart.ram + off : NULL;
+     }
+}
+
+/* Update the page tables for the VRAM. Writes need to sync the GPU so only
+ * reads are direct. */
+void gb_memory_map_vram(struct gb *gb) {
+     const uint8_t *bank = gb->vram + 0x2000 * gb->vram_high_bank;
+
+     for (unsigned page = 0; page < 0x20; page++) {
+          gb->read_map[(VRAM_BASE >> 8) + page] = bank + (page << 8);
+     }
+}
+
+/* Update the page tables for the internal RAM and its echo. Pages holding
+ * cached code are left to the slow path for writes so that the code cache
+ * can be invalidated. */
+void gb_memory_map_iram(struct gb *gb) {
+     for (unsigned page = 0; page < 0x20; page++) {
+          uint16_t off = gb_memory_iram_off(gb, page << 8);
+          uint8_t *w = NULL;
+
+          if (!gb_memory_page_has_code(gb, off)) {
+               w = gb->iram + off;
+          }
+
+          gb->read_map[(IRAM_BASE >> 8) + page] = gb->iram + off;
+          gb->write_map[(IRAM_BASE >> 8) + page] = w;
+
+          if (IRAM_ECHO_BASE + (page << 8) < IRAM_ECHO_END) {
+               gb->read_map[(IRAM_ECHO_BASE >> 8) + page] = gb->iram + off;
+               gb->write_map[(IRAM_ECHO_BASE >> 8) + page] = w;
+          }
+     }
+}
+
+/* Called when the code cache starts tracking code at offset `off` in the
+ * internal RAM: writes to the pages mapping it must now use the slow path */
+void gb_memory_unmap_iram_write(struct gb *gb, uint16_t off) {
+     const uint8_t *p = gb->iram + (off & ~0xffU);
+
+     for (unsigned page = IRAM_BASE >> 8; page < IRAM_ECHO_END >> 8; page++) {
+          if (gb->write_map[page] == p) {
+               gb->write_map[page] = NULL;
+          }
+     }
+}
+
+/* Reset the memory banking and build the page tables. Pages which are never
+ * mapped (OAM, I/O registers and zero page) always use the slow path. */
+void gb_memory_reset(struct gb *gb) {
+     gb->iram_high_bank = 1;
+     gb->vram_high_bank = false;
+
+     memset(gb->read_map, 0, sizeof(gb->read_map));
+     memset(gb->write_map, 0, sizeof(gb->write_map));
+
+     gb_memory_map_rom(gb);
+     gb_memory_map_cram(gb);
+     gb_memory_map_vram(gb);
+     gb_memory_map_iram(gb);
+}
+
 void gb_memory_writeb(struct gb *gb, uint16_t addr, uint8_t val) {
+     uint8_t *page = gb->write_map[addr >> 8];
+
+     if (page != NULL) {
+          /* Plain memory, no side effect */
+          page[addr & 0xff] = val;
+          return;
+     }
 
      if (addr >= ROM_BASE && addr < ROM_END) {
           gb_cart_rom_writeb(gb, addr - ROM_BASE, val);
+          /* The ROM mapping may have changed under the running block */
+          gb->cpu.block_exit = true;
           return;
      }
 
      if (addr >= ZRAM_BASE && addr < ZRAM_END) {
+          gb_memory_ram_code_check(gb, sizeof(gb->iram) + addr - ZRAM_BASE);
           gb->zram[addr - ZRAM_BASE] = val;
           return;
      }
@@ -857,6 +969,7 @@ void gb_memory_writeb(struct gb *gb, uint16_t addr, uint8_t val) {
      if (addr >= IRAM_BASE && addr < IRAM_END) {
           uint16_t off = gb_memory_iram_off(gb, addr - IRAM_BASE);
 
+          gb_memory_ram_code_check(gb, off);
           gb->iram[off] = val;
           return;
      }
@@ -864,6 +977,7 @@ void gb_memory_writeb(struct gb *gb, uint16_t addr, uint8_t val) {
      if (addr >= IRAM_ECHO_BASE && addr < IRAM_ECHO_END) {
           uint16_t off = gb_memory_iram_off(gb, addr - IRAM_ECHO_BASE);
 
+          gb_memory_ram_code_check(gb, off);
           gb->iram[off] = val;
           return;
      }
@@ -875,6 +989,7 @@ void gb_memory_writeb(struct gb *gb, uint16_t addr, uint8_t val) {
 
           gb_gpu_sync(gb);
           gb->vram[off] = val;
+          gb_gpu_vram_written(gb, off);
           return;
      }
 
@@ -886,6 +1001,7 @@ void gb_memory_writeb(struct gb *gb, uint16_t addr, uint8_t val) {
      if (addr >= OAM_BASE && addr < OAM_END) {
           gb_gpu_sync(gb);
           gb->gpu.oam[addr - OAM_BASE] = val;
+          gb_gpu_oam_written(gb, addr - OAM_BASE);
           return;
      }
 
@@ -1242,6 +1358,7 @@ void gb_memory_writeb(struct gb *gb, uint16_t addr, uint8_t val) {
 
      if (gb->gbc && addr == REG_VBK) {
           gb->vram_high_bank = val & 1;
+          gb_memory_map_vram(gb);
           return;
      }
 
@@ -1313,6 +1430,8 @@ void gb_memory_writeb(struct gb *gb, uint16_t addr, uint8_t val) {
           }
 
           p->colors[palette][color_index] = col;
+          p->host_colors[palette][color_index] =
+               gb_pixel_gbc_color_to_xrgb8888(col);
 
           if (p->auto_increment) {
                p->write_index = (p->write_index + 1) & 0x3f;
@@ -1346,6 +1465,8 @@ void gb_memory_writeb(struct gb *gb, uint16_t addr, uint8_t val) {
           }
 
           p->colors[palette][color_index] = col;
+          p->host_colors[palette][color_index] =
+               gb_pixel_gbc_color_to_xrgb8888(col);
 
           if (p->auto_increment) {
                p->write_index = (p->write_index + 1) & 0x3f;
@@ -1356,6 +1477,9 @@ void gb_memory_writeb(struct gb *gb, uint16_t addr, uint8_t val) {
 
      if (gb->gbc && addr == REG_SVBK) {
           gb->iram_high_bank = val & 7;
+          gb_memory_map_iram(gb);
+          /* The RAM mapping may have changed under the running block */
+          gb->cpu.block_exit = true;
           return;
      }
 
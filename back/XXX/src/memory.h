@@ -1,6 +1,12 @@
 #ifndef _GB_MEMORY_H_
 #define _GB_MEMORY_H_
 
+void    gb_memory_reset(struct gb *gb);
+void    gb_memory_map_rom(struct gb *gb);
+void    gb_memory_map_cram(struct gb *gb);
+void    gb_memory_map_vram(struct gb *gb);
+void    gb_memory_map_iram(struct gb *gb);
+void    gb_memory_unmap_iram_write(struct gb *gb, uint16_t off);
 uint8_t gb_memory_readb(struct gb *gb, uint16_t addr);
 void    gb_memory_writeb(struct gb *gb, uint16_t addr, uint8_t val);
 
@@ -0,0 +1,247 @@
+#include "gb.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#ifdef __SSSE3__
+#include <tmmintrin.h>
+#endif
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
+/* Mask selecting the bit of each pixel when a tile byte is replicated in the
+ * 8 bytes of a 64bit value: pixel data is stored "backwards" in VRAM, the
+ * leftmost pixel (x = 0) is stored in the MSB (byte >> 7) */
+#define GB_PIXEL_BIT_MASKS 0x0102040810204080ULL
+
+/* Replicate a byte 8 times */
+static inline uint64_t gb_pixel_splat8(uint8_t b) {
+     return b * 0x0101010101010101ULL;
+}
+
+void gb_pixel_decode_tile(const uint8_t data[16], uint8_t out[8][8]) {
+#if defined(__AVX2__)
+     const __m256i bits = _mm256_set1_epi64x(GB_PIXEL_BIT_MASKS);
+     const __m256i one = _mm256_set1_epi8(1);
+     unsigned y;
+
+     /* 4 rows at a time */
+     for (y = 0; y < 8; y += 4) {
+          const uint8_t *d = data + y * 2;
+          __m256i lsb = _mm256_set_epi64x(gb_pixel_splat8(d[6]),
+                                          gb_pixel_splat8(d[4]),
+                                          gb_pixel_splat8(d[2]),
+                                          gb_pixel_splat8(d[0]));
+          __m256i msb = _mm256_set_epi64x(gb_pixel_splat8(d[7]),
+                                          gb_pixel_splat8(d[5]),
+                                          gb_pixel_splat8(d[3]),
+                                          gb_pixel_splat8(d[1]));
+
+          lsb = _mm256_cmpeq_epi8(_mm256_and_si256(lsb, bits), bits);
+          msb = _mm256_cmpeq_epi8(_mm256_and_si256(msb, bits), bits);
+          lsb = _mm256_and_si256(lsb, one);
+          msb = _mm256_and_si256(msb, _mm256_add_epi8(one, one));
+
+          _mm256_storeu_si256((__m256i *)out[y], _mm256_or_si256(lsb, msb));
+     }
+#elif defined(__SSE2__)
+     const __m128i bits = _mm_set1_epi64x(GB_PIXEL_BIT_MASKS);
+     const __m128i one = _mm_set1_epi8(1);
+     unsigned y;
+
+     /* 2 rows at a time */
+     for (y = 0; y < 8; y += 2) {
+          const uint8_t *d = data + y * 2;
+          __m128i lsb = _mm_set_epi64x(gb_pixel_splat8(d[2]),
+                                       gb_pixel_splat8(d[0]));
+          __m128i msb = _mm_set_epi64x(gb_pixel_splat8(d[3]),
+                                       gb_pixel_splat8(d[1]));
+
+          lsb = _mm_cmpeq_epi8(_mm_and_si128(lsb, bits), bits);
+          msb = _mm_cmpeq_epi8(_mm_and_si128(msb, bits), bits);
+          lsb = _mm_and_si128(lsb, one);
+          msb = _mm_and_si128(msb, _mm_add_epi8(one, one));
+
+          _mm_storeu_si128((__m128i *)out[y], _mm_or_si128(lsb, msb));
+     }
+#else
+     unsigned x;
+     unsigned y;
+
+     for (y = 0; y < 8; y++) {
+          /* The pixel value is two bits split across two contiguous bytes */
+          uint8_t lsb = data[y * 2 + 0];
+          uint8_t msb = data[y * 2 + 1];
+
+          for (x = 0; x < 8; x++) {
+               unsigned shift = 7 - x;
+
+               out[y][x] = (((msb >> shift) & 1) << 1) | ((lsb >> shift) & 1);
+          }
+     }
+#endif
+}
+
+void gb_pixel_map_dmg(const uint8_t *index, const uint8_t shades[16],
+                      union gb_gpu_color *out, unsigned n) {
+#if defined(__SSSE3__)
+     const __m128i table = _mm_loadu_si128((const __m128i *)shades);
+     unsigned i;
+
+     for (i = 0; i < n; i += 16) {
+          __m128i idx = _mm_loadu_si128((const __m128i *)(index + i));
+          __m128i s = _mm_shuffle_epi8(table, idx);
+#if defined(__AVX2__)
+          _mm256_storeu_si256((__m256i *)(out + i),
+                              _mm256_cvtepu8_epi32(s));
+          _mm256_storeu_si256((__m256i *)(out + i + 8),
+                              _mm256_cvtepu8_epi32(_mm_srli_si128(s, 8)));
+#else
+          const __m128i zero = _mm_setzero_si128();
+          __m128i lo = _mm_unpacklo_epi8(s, zero);
+          __m128i hi = _mm_unpackhi_epi8(s, zero);
+
+          _mm_storeu_si128((__m128i *)(out + i),
+                           _mm_unpacklo_epi16(lo, zero));
+          _mm_storeu_si128((__m128i *)(out + i + 4),
+                           _mm_unpackhi_epi16(lo, zero));
+          _mm_storeu_si128((__m128i *)(out + i + 8),
+                           _mm_unpacklo_epi16(hi, zero));
+          _mm_storeu_si128((__m128i *)(out + i + 12),
+                           _mm_unpackhi_epi16(hi, zero));
+#endif
+     }
+#else
+     unsigned i;
+
+     for (i = 0; i < n; i++) {
+          out[i].dmg_color = shades[index[i]];
+     }
+#endif
+}
+
+void gb_pixel_map_gbc(const uint8_t *index, const uint16_t *colors,
+                      union gb_gpu_color *out, unsigned n) {
+#if defined(__AVX2__)
+     const __m256i mask = _mm256_set1_epi32(0xffff);
+     unsigned i;
+
+     for (i = 0; i < n; i += 8) {
+          __m128i idx8 = _mm_loadl_epi64((const __m128i *)(index + i));
+          __m256i idx = _mm256_cvtepu8_epi32(idx8);
+          /* Each lane loads 32bits, the high half is the next color (or the
+           * padding entry) and is masked out */
+          __m256i c = _mm256_i32gather_epi32((const int *)colors, idx, 2);
+
+          _mm256_storeu_si256((__m256i *)(out + i),
+                              _mm256_and_si256(c, mask));
+     }
+#else
+     unsigned i;
+
+     for (i = 0; i < n; i++) {
+          out[i].gbc_color = colors[index[i]];
+     }
+#endif
+}
+
+void gb_pixel_map_xrgb8888(const uint8_t *index, const uint32_t *colors,
+                           uint32_t *out, unsigned n) {
+#if defined(__AVX2__)
+     unsigned i;
+
+     for (i = 0; i < n; i += 8) {
+          __m128i idx8 = _mm_loadl_epi64((const __m128i *)(index + i));
+          __m256i idx = _mm256_cvtepu8_epi32(idx8);
+          __m256i c = _mm256_i32gather_epi32((const int *)colors, idx, 4);
+
+          _mm256_storeu_si256((__m256i *)(out + i), c);
+     }
+#else
+     unsigned i;
+
+     for (i = 0; i < n; i++) {
+          out[i] = colors[index[i]];
+     }
+#endif
+}
+
+void gb_pixel_dmg_to_xrgb8888(const union gb_gpu_color *line,
+                              const uint32_t col_map[4],
+                              uint32_t *out, unsigned n) {
+#if defined(__SSE2__)
+     const __m128i c0 = _mm_set1_epi32(col_map[0]);
+     const __m128i c1 = _mm_set1_epi32(col_map[1]);
+     const __m128i c2 = _mm_set1_epi32(col_map[2]);
+     const __m128i c3 = _mm_set1_epi32(col_map[3]);
+     const __m128i one = _mm_set1_epi32(1);
+     const __m128i two = _mm_set1_epi32(2);
+     const __m128i three = _mm_set1_epi32(3);
+     unsigned i;
+
+     for (i = 0; i < n; i += 4) {
+          __m128i v = _mm_loadu_si128((const __m128i *)(line + i));
+          __m128i p;
+
+          p = _mm_and_si128(_mm_cmpeq_epi32(v, _mm_setzero_si128()), c0);
+          p = _mm_or_si128(p, _mm_and_si128(_mm_cmpeq_epi32(v, one), c1));
+          p = _mm_or_si128(p, _mm_and_si128(_mm_cmpeq_epi32(v, two), c2));
+          p = _mm_or_si128(p, _mm_and_si128(_mm_cmpeq_epi32(v, three), c3));
+
+          _mm_storeu_si128((__m128i *)(out + i), p);
+     }
+#else
+     unsigned i;
+
+     for (i = 0; i < n; i++) {
+          out[i] = col_map[line[i].dmg_color];
+     }
+#endif
+}
+
+static uint32_t gb_pixel_5_to_8bits(uint32_t v) {
+     return (v << 3) | (v >> 2);
+}
+
+uint32_t gb_pixel_gbc_color_to_xrgb8888(uint16_t c) {
+     uint32_t r = gb_pixel_5_to_8bits(c & 0x1f);
+     uint32_t g = gb_pixel_5_to_8bits((c >> 5) & 0x1f);
+     uint32_t b = gb_pixel_5_to_8bits((c >> 10) & 0x1f);
+
+     return 0xff000000 | (r << 16) | (g << 8) | b;
+}
+
+void gb_pixel_gbc_to_xrgb8888(const union gb_gpu_color *line,
+                              uint32_t *out, unsigned n) {
+#if defined(__SSE2__)
+     const __m128i mask5 = _mm_set1_epi32(0x1f);
+     const __m128i alpha = _mm_set1_epi32(0xff000000);
+     unsigned i;
+
+     for (i = 0; i < n; i += 4) {
+          __m128i v = _mm_loadu_si128((const __m128i *)(line + i));
+          __m128i r = _mm_and_si128(v, mask5);
+          __m128i g = _mm_and_si128(_mm_srli_epi32(v, 5), mask5);
+          __m128i b = _mm_and_si128(_mm_srli_epi32(v, 10), mask5);
+          __m128i p;
+
+          /* Extend from 5 to 8 bits */
+          r = _mm_or_si128(_mm_slli_epi32(r, 3), _mm_srli_epi32(r, 2));
+          g = _mm_or_si128(_mm_slli_epi32(g, 3), _mm_srli_epi32(g, 2));
+          b = _mm_or_si128(_mm_slli_epi32(b, 3), _mm_srli_epi32(b, 2));
+
+          p = _mm_or_si128(alpha, _mm_slli_epi32(r, 16));
+          p = _mm_or_si128(p, _mm_slli_epi32(g, 8));
+          p = _mm_or_si128(p, b);
+
+          _mm_storeu_si128((__m128i *)(out + i), p);
+     }
+#else
+     unsigned i;
+
+     for (i = 0; i < n; i++) {
+          out[i] = gb_pixel_gbc_color_to_xrgb8888(line[i].gbc_color);
+     }
+#endif
+}
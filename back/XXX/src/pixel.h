@@ -0,0 +1,39 @@
+#ifndef _GB_PIXEL_H_
+#define _GB_PIXEL_H_
+
+/* Pixel processing kernels used by the GPU and the frontends. They use SSE2,
+ * SSSE3 or AVX2 when the compiler targets them (SSE2 is always available on
+ * x86-64, build with -mavx2 or -march=native for the others) and plain C
+ * otherwise. The line kernels process `n` pixels, `n` must be a multiple of
+ * 16. */
+
+/* Decode the 16 bytes of a tile to one color index per pixel, leftmost pixel
+ * first */
+void gb_pixel_decode_tile(const uint8_t data[16], uint8_t out[8][8]);
+
+/* Map palette indices through a table of 16 DMG shades */
+void gb_pixel_map_dmg(const uint8_t *index, const uint8_t shades[16],
+                      union gb_gpu_color *out, unsigned n);
+
+/* Map palette indices through a table of GBC colors. The table must have one
+ * padding entry after the last color that can be indexed. */
+void gb_pixel_map_gbc(const uint8_t *index, const uint16_t *colors,
+                      union gb_gpu_color *out, unsigned n);
+
+/* Convert DMG shades to host pixels using a map of 4 colors */
+void gb_pixel_dmg_to_xrgb8888(const union gb_gpu_color *line,
+                              const uint32_t col_map[4],
+                              uint32_t *out, unsigned n);
+
+/* Map palette indices through a table of host xRGB 8888 colors */
+void gb_pixel_map_xrgb8888(const uint8_t *index, const uint32_t *colors,
+                           uint32_t *out, unsigned n);
+
+/* Convert one GBC xBGR 1555 color to a host xRGB 8888 pixel */
+uint32_t gb_pixel_gbc_color_to_xrgb8888(uint16_t c);
+
+/* Convert GBC xBGR 1555 colors to host xRGB 8888 pixels */
+void gb_pixel_gbc_to_xrgb8888(const union gb_gpu_color *line,
+                              uint32_t *out, unsigned n);
+
+#endif /* _GB_PIXEL_H_ */
@@ -1,9 +1,34 @@
 #include <SDL.h>
-#include <assert.h>
+#include <stdatomic.h>
 #include "gb.h"
 
 #define UPSCALE_FACTOR 4
 
+/* In fast-forward mode only one frame out of GB_SDL_FF_PERIOD is drawn */
+#define GB_SDL_FF_PERIOD 8
+
+/* Audio latency: length of the SPU's audio ring and number of frames
+ * requested by the audio device at once */
+#define GB_SDL_AUDIO_LATENCY_MS 40
+#define GB_SDL_AUDIO_SAMPLES    512
+/* Preferred audio sample rate, the SPU synthesizes at whatever rate the
+ * device actually uses */
+#define GB_SDL_AUDIO_RATE_HZ    48000
+
+/* Number of frame buffers exchanged with the main thread: one being
+ * drawn, one ready to be presented and one being presented */
+#define GB_SDL_FRAME_COUNT 3
+/* Set in `ready` when it holds a frame the main thread hasn't picked up
+ * yet */
+#define GB_SDL_FRAME_FRESH 0x4U
+
+/* Max number of input events waiting for the emulation thread */
+#define GB_SDL_INPUT_QUEUE 64
+
+struct gb_sdl_frame {
+     uint32_t lines[GB_LCD_HEIGHT][GB_LCD_WIDTH];
+};
+
 struct gb_sdl_context {
      SDL_Window *window;
      SDL_Renderer *renderer;
@@ -11,17 +36,65 @@ struct gb_sdl_context {
      SDL_GameController *controller;
      SDL_AudioSpec audio_spec;
      SDL_AudioDeviceID audio_device;
-     uint32_t pixels[GB_LCD_WIDTH * GB_LCD_HEIGHT * UPSCALE_FACTOR * UPSCALE_FACTOR];
-     /* Index of the next audio buffer we want to play */
-     unsigned audio_buf_index;
+     /* True while the audio device is paused for fast-forward. Only used by
+      * the emulation thread. */
+     bool audio_paused;
+     /* Triple-buffered frames. The GPU draws into `frames[back]`, the main
+      * thread owns `frames[front]` and `ready` holds the index of the
+      * remaining one, with GB_SDL_FRAME_FRESH set if it's a new frame. The
+      * buffers change hands by swapping their indices with `ready`. */
+     struct gb_sdl_frame frames[GB_SDL_FRAME_COUNT];
+     unsigned back;
+     unsigned front;
+     atomic_uint ready;
+     /* Lines currently in the canvas texture, only used by the main
+      * thread */
+     uint32_t shown[GB_LCD_HEIGHT][GB_LCD_WIDTH];
+     /* Emulation thread. SDL wants the window, the renderer, the canvas
+      * texture and the event pump on a single thread so they all stay on the
+      * main thread, which presents the frames so that vsync and compositor
+      * stalls never block the emulation. */
+     pthread_t emulator;
+     /* Event pushed to wake the main thread up when a frame is ready */
+     Uint32 wake_event;
+     /* True if a wake event is already queued */
+     atomic_bool wake_pending;
+     /* True if the window must be presented even if the frame didn't
+      * change */
+     bool force_present;
+     /* Set to stop both threads */
+     atomic_bool quit;
+     /* If true the emulation is paced by the display refresh instead of the
+      * audio: the main thread presents at every vsync and the emulation
+      * waits for it after each frame */
+     atomic_bool video_sync;
+     /* Posted by the main thread at every vsync in video sync mode */
+     sem_t vsync_sem;
+     /* Key and button events forwarded by the main thread to the emulation
+      * thread */
+     SDL_Event input[GB_SDL_INPUT_QUEUE];
+     unsigned input_head;
+     unsigned input_tail;
+     pthread_mutex_t input_lock;
 };
 
+/* Wake the main thread up. Can be called from any thread. */
+static void gb_sdl_wake(struct gb_sdl_context *ctx) {
+     SDL_Event e;
+
+     if (atomic_exchange(&ctx->wake_pending, true)) {
+          /* Already queued */
+          return;
+     }
+
+     SDL_zero(e);
+     e.type = ctx->wake_event;
+     SDL_PushEvent(&e);
+}
+
 static void gb_sdl_draw_line_dmg(struct gb *gb, unsigned ly,
                                  union gb_gpu_color line[GB_LCD_WIDTH]) {
      struct gb_sdl_context *ctx = gb->frontend.data;
-     unsigned i;
-     unsigned x;
-     unsigned y;
 
      static const uint32_t col_map[4] = {
           [GB_COL_WHITE]     = 0xff75a32c,
@@ -30,58 +103,74 @@ static void gb_sdl_draw_line_dmg(struct gb *gb, unsigned ly,
           [GB_COL_BLACK]     = 0xff12280b,
      };
 
-     for (i = 0; i < GB_LCD_WIDTH; i++) {
-          for (y = 0; y < UPSCALE_FACTOR; y++) {
-               for (x = 0; x < UPSCALE_FACTOR; x++) {
-                    ctx->pixels[(ly + y) * GB_LCD_WIDTH * UPSCALE_FACTOR + i + x] = col_map[line[i].dmg_color];
-               }
-          }
-     }
+     gb_pixel_dmg_to_xrgb8888(line, col_map, ctx->frames[ctx->back].lines[ly],
+                              GB_LCD_WIDTH);
 }
 
-static uint32_t gb_sdl_5_to_8bits(uint32_t v) {
-     return (v << 3) | (v >> 2);
+static void gb_sdl_draw_line_xrgb8888(struct gb *gb, unsigned ly,
+                                      const uint32_t pixels[GB_LCD_WIDTH]) {
+     struct gb_sdl_context *ctx = gb->frontend.data;
+
+     memcpy(ctx->frames[ctx->back].lines[ly], pixels,
+            sizeof(ctx->frames[0].lines[0]));
 }
 
-static uint32_t gb_sdl_gbc_to_xrgb8888(uint16_t c) {
-     uint32_t r = c & 0x1f;
-     uint32_t g = (c >> 5) & 0x1f;
-     uint32_t b = (c >> 10) & 0x1f;
-     uint32_t p;
+/* Toggle the unthrottled fast-forward mode */
+static void gb_sdl_toggle_fast_forward(struct gb *gb) {
+     struct gb_sdl_context *ctx = gb->frontend.data;
+     bool enable = !gb->spu.unthrottled;
+
+     gb->spu.unthrottled = enable;
+     /* Most of the samples would be dropped anyway, don't bother
+      * synthesizing them */
+     gb->spu.mute = enable;
 
-     /* Extend from 5 to 8 bits */
-     r = gb_sdl_5_to_8bits(r);
-     g = gb_sdl_5_to_8bits(g);
-     b = gb_sdl_5_to_8bits(b);
+     if (enable) {
+          /* The muted SPU doesn't fill the ring anymore, stop the playback
+           * instead of letting the audio callback underrun */
+          SDL_PauseAudioDevice(ctx->audio_device, 1);
+          ctx->audio_paused = true;
 
-     p = 0xff000000;
-     p |= r << 16;
-     p |= g << 8;
-     p |= b;
+          gb->gpu.skip_frames = GB_SDL_FF_PERIOD - 1;
+          gb->gpu.skip_period = GB_SDL_FF_PERIOD;
+     } else {
+          /* Drop the samples left over from before the fast-forward. The
+           * audio callback can't run while the device is paused, the
+           * playback resumes in gb_sdl_flip once the ring is refilled. */
+          gb_spu_ring_clear(&gb->spu.ring);
 
-     return p;
+          gb->gpu.skip_frames = 0;
+          gb->gpu.skip_period = 0;
+     }
 }
 
-static void gb_sdl_draw_line_gbc(struct gb *gb, unsigned ly,
-                                 union gb_gpu_color line[GB_LCD_WIDTH]) {
+/* Toggle between pacing the emulation to the audio and to the display */
+static void gb_sdl_toggle_video_sync(struct gb *gb) {
      struct gb_sdl_context *ctx = gb->frontend.data;
-     unsigned i;
-     unsigned x;
-     unsigned y;
+     bool enable = !atomic_load(&ctx->video_sync);
 
-     for (i = 0; i < GB_LCD_WIDTH; i++) {
-          uint16_t c = line[i].gbc_color;
+     /* The SPU adjusts its rate to match the display instead of blocking */
+     gb->spu.rate_control = enable;
+     atomic_store(&ctx->video_sync, enable);
 
-          for (y = 0; y < UPSCALE_FACTOR; y++) {
-               for (x = 0; x < UPSCALE_FACTOR; x++) {
-                    ctx->pixels[(ly + y) * GB_LCD_WIDTH * UPSCALE_FACTOR + i + x] = gb_sdl_gbc_to_xrgb8888(c);
-               }
-          }
-     }
+     /* Wake the main thread up in case it's waiting for a frame */
+     gb_sdl_wake(ctx);
+
+     printf("Video sync %s\n", enable ? "enabled" : "disabled");
 }
 
 static void gb_sdl_handle_key(struct gb *gb, SDL_Keycode key, bool pressed) {
      switch (key) {
+     case SDLK_TAB:
+          if (pressed) {
+               gb_sdl_toggle_fast_forward(gb);
+          }
+          break;
+     case SDLK_v:
+          if (pressed) {
+               gb_sdl_toggle_video_sync(gb);
+          }
+          break;
      case SDLK_q:
      case SDLK_ESCAPE:
           if (pressed) {
@@ -201,49 +290,275 @@ static void gb_sdl_handle_controller_removed(struct gb *gb, Sint32 which) {
      }
 }
 
-static void gb_sdl_refresh_input(struct gb *gb) {
-     SDL_Event e;
+/* Handle an event on the main thread. Input events are forwarded to the
+ * emulation thread. */
+static void gb_sdl_handle_event(struct gb *gb, const SDL_Event *e) {
+     struct gb_sdl_context *ctx = gb->frontend.data;
 
-     while(SDL_PollEvent(&e)) {
-          switch (e.type) {
-          case SDL_QUIT:
-               gb->quit = true;
+     if (e->type == ctx->wake_event) {
+          atomic_store(&ctx->wake_pending, false);
+          return;
+     }
+
+     switch (e->type) {
+     case SDL_QUIT:
+          atomic_store(&ctx->quit, true);
+          break;
+     case SDL_WINDOWEVENT:
+          if (e->window.event == SDL_WINDOWEVENT_EXPOSED ||
+              e->window.event == SDL_WINDOWEVENT_SIZE_CHANGED) {
+               /* The window contents must be redrawn even if the frame
+                * doesn't change */
+               ctx->force_present = true;
+          }
+          break;
+     case SDL_KEYDOWN:
+     case SDL_KEYUP:
+          if (e->key.repeat) {
+               /* Ignore auto-repeat, it would toggle fast-forward on and off
+                * while the key is held */
                break;
+          }
+          /* Fallthrough */
+     case SDL_CONTROLLERBUTTONDOWN:
+     case SDL_CONTROLLERBUTTONUP:
+          pthread_mutex_lock(&ctx->input_lock);
+          if (ctx->input_head - ctx->input_tail < GB_SDL_INPUT_QUEUE) {
+               ctx->input[ctx->input_head % GB_SDL_INPUT_QUEUE] = *e;
+               ctx->input_head++;
+          }
+          pthread_mutex_unlock(&ctx->input_lock);
+          break;
+     case SDL_CONTROLLERDEVICEREMOVED:
+          gb_sdl_handle_controller_removed(gb, e->cdevice.which);
+          break;
+     case SDL_CONTROLLERDEVICEADDED:
+          gb_sdl_handle_new_controller(gb, e->cdevice.which);
+          break;
+     }
+}
+
+/* Called by the emulation thread to process the input events forwarded by
+ * the main thread */
+static void gb_sdl_refresh_input(struct gb *gb) {
+     struct gb_sdl_context *ctx = gb->frontend.data;
+     SDL_Event input[GB_SDL_INPUT_QUEUE];
+     unsigned n = 0;
+     unsigned i;
+
+     pthread_mutex_lock(&ctx->input_lock);
+     while (ctx->input_tail != ctx->input_head) {
+          input[n++] = ctx->input[ctx->input_tail % GB_SDL_INPUT_QUEUE];
+          ctx->input_tail++;
+     }
+     pthread_mutex_unlock(&ctx->input_lock);
+
+     for (i = 0; i < n; i++) {
+          const SDL_Event *e = &input[i];
+
+          switch (e->type) {
           case SDL_KEYDOWN:
           case SDL_KEYUP:
-               gb_sdl_handle_key(gb, e.key.keysym.sym,
-                                 (e.key.state == SDL_PRESSED));
+               gb_sdl_handle_key(gb, e->key.keysym.sym,
+                                 (e->key.state == SDL_PRESSED));
                break;
           case SDL_CONTROLLERBUTTONDOWN:
           case SDL_CONTROLLERBUTTONUP:
-               gb_sdl_handle_button(gb, e.cbutton.button,
-                                    e.cbutton.state == SDL_PRESSED);
-               break;
-          case SDL_CONTROLLERDEVICEREMOVED:
-               gb_sdl_handle_controller_removed(gb, e.cdevice.which);
-               break;
-          case SDL_CONTROLLERDEVICEADDED:
-               gb_sdl_handle_new_controller(gb, e.cdevice.which);
+               gb_sdl_handle_button(gb, e->cbutton.button,
+                                    e->cbutton.state == SDL_PRESSED);
                break;
           }
      }
+
+     if (atomic_load(&ctx->quit)) {
+          gb->quit = true;
+     }
 }
 
+/* Publish the frame we just drew and start drawing the next one in the
+ * buffer the main thread doesn't use. If it didn't pick up the
+ * previous frame in time it's replaced by this one. Only blocks in video
+ * sync mode, to wait for the next vsync. */
 static void gb_sdl_flip(struct gb *gb) {
      struct gb_sdl_context *ctx = gb->frontend.data;
+     unsigned prev;
+
+     prev = atomic_exchange(&ctx->ready, ctx->back | GB_SDL_FRAME_FRESH);
+     ctx->back = prev & ~GB_SDL_FRAME_FRESH;
+
+     /* The GPU redraws every line before the next flip so we don't need to
+      * copy anything into the new back buffer */
+     gb_sdl_wake(ctx);
+
+     /* Resume the audio after a fast-forward once there's enough buffered to
+      * avoid an underrun */
+     if (ctx->audio_paused && !gb->spu.unthrottled &&
+         gb_spu_ring_fill(&gb->spu.ring) >= gb->spu.ring.capacity / 2) {
+          SDL_PauseAudioDevice(ctx->audio_device, 0);
+          ctx->audio_paused = false;
+     }
 
-     /* Copy pixels to the canvas texture */
-     SDL_UpdateTexture(ctx->canvas, NULL, ctx->pixels,
-                       GB_LCD_WIDTH * UPSCALE_FACTOR * sizeof(ctx->pixels[0]));
+     if (atomic_load(&ctx->video_sync) && !gb->spu.unthrottled &&
+         !atomic_load(&ctx->quit)) {
+          sem_wait(&ctx->vsync_sem);
+     }
+}
+
+/* Upload the lines of `frame` that changed since the last present and
+ * present it. Returns false if the frame was identical. */
+static bool gb_sdl_present_frame(struct gb_sdl_context *ctx,
+                                 const struct gb_sdl_frame *frame) {
+     unsigned first = GB_LCD_HEIGHT;
+     unsigned last = 0;
+     unsigned ly;
+
+     for (ly = 0; ly < GB_LCD_HEIGHT; ly++) {
+          if (memcmp(ctx->shown[ly], frame->lines[ly],
+                     sizeof(ctx->shown[ly])) != 0) {
+               if (ly < first) {
+                    first = ly;
+               }
+               last = ly;
+          }
+     }
+
+     if (first <= last) {
+          /* Upload the lines modified since the last present. The texture
+           * has the native resolution of the LCD, the renderer upscales
+           * it. */
+          SDL_Rect rect = {
+               .x = 0,
+               .y = first,
+               .w = GB_LCD_WIDTH,
+               .h = last - first + 1,
+          };
+
+          SDL_UpdateTexture(ctx->canvas, &rect, frame->lines[first],
+                            sizeof(frame->lines[0]));
+          memcpy(ctx->shown[first], frame->lines[first],
+                 rect.h * sizeof(frame->lines[0]));
+     } else if (!ctx->force_present) {
+          /* Same frame as before, nothing to do */
+          return false;
+     }
+
+     ctx->force_present = false;
 
      /* Render the canvas */
      SDL_RenderCopy(ctx->renderer, ctx->canvas, NULL, NULL);
      SDL_RenderPresent(ctx->renderer);
+
+     return true;
+}
+
+static void gb_sdl_create_canvas(struct gb_sdl_context *ctx) {
+     ctx->renderer = SDL_CreateRenderer(ctx->window, -1,
+                                        SDL_RENDERER_PRESENTVSYNC);
+     if (ctx->renderer == NULL) {
+          fprintf(stderr, "SDL_CreateRenderer failed: %s\n", SDL_GetError());
+          die();
+     }
+
+     ctx->canvas = SDL_CreateTexture(ctx->renderer,
+                                     SDL_PIXELFORMAT_ARGB8888,
+                                     SDL_TEXTUREACCESS_STREAMING,
+                                     GB_LCD_WIDTH, GB_LCD_HEIGHT);
+     if (ctx->canvas == NULL) {
+          fprintf(stderr, "SDL_CreateTexture failed: %s\n", SDL_GetError());
+          die();
+     }
+
+     /* Clear the canvas */
+     memset(ctx->shown, 0, sizeof(ctx->shown));
+     SDL_UpdateTexture(ctx->canvas, NULL, ctx->shown, sizeof(ctx->shown[0]));
+     SDL_RenderCopy(ctx->renderer, ctx->canvas, NULL, NULL);
+     SDL_RenderPresent(ctx->renderer);
+}
+
+/* Emulation thread */
+static void *gb_sdl_emulator_run(void *data) {
+     struct gb *gb = data;
+     struct gb_sdl_context *ctx = gb->frontend.data;
+
+     while (!gb->quit) {
+          gb->frontend.refresh_input(gb);
+
+          /* We refresh the input at 120Hz. This is a trade-off, if we refresh
+           * faster we'll reduce latency at the cost of performance. */
+          gb_cpu_run_cycles(gb, GB_CPU_FREQ_HZ / 120);
+     }
+
+     /* Tell the main thread in case the quit came from the emulator */
+     atomic_store(&ctx->quit, true);
+     gb_sdl_wake(ctx);
+
+     return NULL;
+}
+
+void gb_sdl_run(struct gb *gb) {
+     struct gb_sdl_context *ctx = gb->frontend.data;
+
+     if (pthread_create(&ctx->emulator, NULL, gb_sdl_emulator_run, gb)) {
+          perror("pthread_create failed");
+          die();
+     }
+
+     while (!atomic_load(&ctx->quit)) {
+          bool video_sync = atomic_load(&ctx->video_sync);
+          SDL_Event e;
+
+          if (video_sync) {
+               /* We present at every vsync, new frame or not */
+               while (SDL_PollEvent(&e)) {
+                    gb_sdl_handle_event(gb, &e);
+               }
+               ctx->force_present = true;
+          } else if (SDL_WaitEvent(&e)) {
+               /* Wait for a new frame or some input */
+               do {
+                    gb_sdl_handle_event(gb, &e);
+               } while (SDL_PollEvent(&e));
+          }
+
+          if (atomic_load(&ctx->quit)) {
+               break;
+          }
+
+          if (atomic_load(&ctx->ready) & GB_SDL_FRAME_FRESH) {
+               /* Take the new frame and give our old one back */
+               unsigned fresh = atomic_exchange(&ctx->ready, ctx->front);
+
+               ctx->front = fresh & ~GB_SDL_FRAME_FRESH;
+          }
+
+          gb_sdl_present_frame(ctx, &ctx->frames[ctx->front]);
+
+          if (video_sync) {
+               int pending;
+
+               /* Let the emulation run one frame. If it's late we don't let
+                * it run several frames in a row to catch up. */
+               if (sem_getvalue(&ctx->vsync_sem, &pending) == 0 &&
+                   pending == 0) {
+                    sem_post(&ctx->vsync_sem);
+               }
+          }
+     }
+
+     /* The emulation might be waiting for the next vsync */
+     sem_post(&ctx->vsync_sem);
+     pthread_join(ctx->emulator, NULL);
 }
 
 static void gb_sdl_destroy(struct gb *gb) {
      struct gb_sdl_context *ctx = gb->frontend.data;
 
+     SDL_CloseAudioDevice(ctx->audio_device);
+     gb_spu_ring_destroy(gb);
+
+     sem_destroy(&ctx->vsync_sem);
+     pthread_mutex_destroy(&ctx->input_lock);
+
      if (ctx->controller) {
           SDL_GameControllerClose(ctx->controller);
      }
@@ -260,26 +575,15 @@ static void gb_sdl_audio_callback(void *userdata,
                                   Uint8 *stream,
                                   int len) {
      struct gb *gb = userdata;
-     struct gb_sdl_context *ctx = gb->frontend.data;
-     struct gb_spu_sample_buffer *buf = &gb->spu.buffers[ctx->audio_buf_index];
-
-     /* Normally the frontend should always request exactly the correct length
-      */
-     assert(len == sizeof(buf->samples));
+     int16_t (*samples)[2] = (int16_t (*)[2])stream;
+     unsigned n = len / sizeof(*samples);
+     unsigned got;
 
-     if (sem_trywait(&buf->ready) == 0) {
-          /* Buffer is ready */
-          memcpy(stream, buf->samples, sizeof(buf->samples));
-
-          /* Tell the SPU that it can refill this buffer */
-          sem_post(&buf->free);
-          /* Move on to the next buffer */
-          ctx->audio_buf_index = (ctx->audio_buf_index + 1)
-               % GB_SPU_SAMPLE_BUFFER_COUNT;
-     } else {
-          /* Buffer is not ready yet, we're running slow! */
+     got = gb_spu_ring_read(&gb->spu.ring, samples, n);
+     if (got < n) {
+          /* Not enough samples ready, we're running slow! */
           fprintf(stderr, "Emulator is running too slow!\n");
-          memset(stream, 0, sizeof(buf->samples));
+          memset(samples + got, 0, (n - got) * sizeof(*samples));
      }
 }
 
@@ -295,8 +599,6 @@ void gb_sdl_frontend_init(struct gb *gb) {
 
      gb->frontend.data = ctx;
 
-     ctx->audio_buf_index = 0;
-
      if (SDL_Init(SDL_INIT_VIDEO |
                   SDL_INIT_GAMECONTROLLER |
                   SDL_INIT_AUDIO) < 0) {
@@ -304,53 +606,76 @@ void gb_sdl_frontend_init(struct gb *gb) {
           die();
      }
 
-     if (SDL_CreateWindowAndRenderer(GB_LCD_WIDTH * UPSCALE_FACTOR, GB_LCD_HEIGHT * UPSCALE_FACTOR,
-                                     0, &ctx->window, &ctx->renderer) < 0) {
-          fprintf(stderr, "SDL_CreateWindowAndRenderer failed: %s\n",
-                  SDL_GetError());
+     ctx->window = SDL_CreateWindow("Gaembuoy",
+                                    SDL_WINDOWPOS_UNDEFINED,
+                                    SDL_WINDOWPOS_UNDEFINED,
+                                    GB_LCD_WIDTH * UPSCALE_FACTOR,
+                                    GB_LCD_HEIGHT * UPSCALE_FACTOR,
+                                    0);
+     if (ctx->window == NULL) {
+          fprintf(stderr, "SDL_CreateWindow failed: %s\n", SDL_GetError());
           die();
      }
 
-     SDL_SetWindowTitle(ctx->window, "Gaembuoy");
+     gb_sdl_create_canvas(ctx);
+
+     memset(ctx->frames, 0, sizeof(ctx->frames));
+     ctx->back = 0;
+     ctx->front = 1;
+     atomic_init(&ctx->ready, 2);
+     ctx->force_present = false;
+     atomic_init(&ctx->wake_pending, false);
+     atomic_init(&ctx->quit, false);
+     atomic_init(&ctx->video_sync, false);
+     ctx->input_head = 0;
+     ctx->input_tail = 0;
+
+     ctx->wake_event = SDL_RegisterEvents(1);
+     if (ctx->wake_event == (Uint32)-1) {
+          fprintf(stderr, "SDL_RegisterEvents failed: %s\n", SDL_GetError());
+          die();
+     }
 
-     ctx->canvas = SDL_CreateTexture(ctx->renderer,
-                                     SDL_PIXELFORMAT_ARGB8888,
-                                     SDL_TEXTUREACCESS_STREAMING,
-                                     GB_LCD_WIDTH, GB_LCD_HEIGHT);
-     if (ctx->canvas == NULL) {
-          fprintf(stderr, "SDL_CreateTexture failed: %s\n", SDL_GetError());
+     if (sem_init(&ctx->vsync_sem, 0, 0)) {
+          perror("sem_init failed");
+          die();
+     }
+
+     if (pthread_mutex_init(&ctx->input_lock, NULL)) {
+          perror("pthread_mutex_init failed");
           die();
      }
 
      SDL_memset(&want, 0, sizeof(want));
-     want.freq = GB_SPU_SAMPLE_RATE_HZ;
+     want.freq = GB_SDL_AUDIO_RATE_HZ;
      want.format = AUDIO_S16SYS;
      want.channels = 2;
-     want.samples = GB_SPU_SAMPLE_BUFFER_LENGTH;
+     want.samples = GB_SDL_AUDIO_SAMPLES;
      want.callback = gb_sdl_audio_callback;
      want.userdata = gb;
 
      ctx->audio_device = SDL_OpenAudioDevice(NULL, 0,
                                              &want, &ctx->audio_spec,
-                                             0 /* No changes allowed */);
+                                             SDL_AUDIO_ALLOW_FREQUENCY_CHANGE);
      if (ctx->audio_device == 0) {
           fprintf(stderr, "SDL_OpenAudioDevice failed: %s\n", SDL_GetError());
           die();
      }
 
+     gb_spu_ring_init(gb, ctx->audio_spec.freq, GB_SDL_AUDIO_LATENCY_MS);
+
      /* Start audio */
      SDL_PauseAudioDevice(ctx->audio_device, 0);
+     ctx->audio_paused = false;
 
      gb->frontend.draw_line_dmg = gb_sdl_draw_line_dmg;
-     gb->frontend.draw_line_gbc = gb_sdl_draw_line_gbc;
+     /* GBC lines are mapped directly to host pixels by the GPU */
+     gb->frontend.draw_line_gbc = NULL;
+     gb->frontend.draw_line_xrgb8888 = gb_sdl_draw_line_xrgb8888;
      gb->frontend.flip = gb_sdl_flip;
      gb->frontend.refresh_input = gb_sdl_refresh_input;
      gb->frontend.destroy = gb_sdl_destroy;
 
-     /* Clear the canvas */
-     memset(ctx->pixels, 0, sizeof(ctx->pixels));
-     gb_sdl_flip(gb);
-
      ctx->controller = NULL;
      gb_sdl_find_controller(gb);
 }
@@ -2,6 +2,10 @@
 #define _GB_SDL_H_
 
 void gb_sdl_frontend_init(struct gb *gb);
+/* Run the emulator in its own thread while the calling thread, which must be
+ * the one that called gb_sdl_frontend_init, handles the window and the
+ * events. Returns when the user quits. */
+void gb_sdl_run(struct gb *gb);
 void gb_sdl_frontend_destroy(struct gb *gb);
 
 #endif /* _GB_SDL_H_ */
@@ -1,6 +1,9 @@
 #include <stdio.h>
+#include <string.h>
+#include <math.h>
 #include "gb.h"
 
+
 void gb_spu_update_sound_amp(struct gb *gb) {
      struct gb_spu *spu = &gb->spu;
      unsigned sound;
@@ -39,22 +42,96 @@ void gb_spu_update_sound_amp(struct gb *gb) {
      }
 }
 
+/* Number of cycles between two steps of the divider */
+static uint32_t gb_spu_frequency_period(const struct gb_spu_divider *f) {
+     return 2 * (0x800U - f->offset);
+}
+
 static void gb_spu_frequency_reload(struct gb_spu_divider *f) {
-     f->counter = 2 * (0x800U - f->offset);
+     f->counter = gb_spu_frequency_period(f);
 }
 
-static void gb_spu_lfsr_counter_reload(struct gb_spu_nr4 *nr4) {
+/* Number of cycles between two LFSR shifts */
+static uint32_t gb_spu_lfsr_period(const struct gb_spu_nr4 *nr4) {
      /* The LFSR clock has a divider and a shifter */
      uint8_t div = nr4->lfsr_config & 7;
      uint8_t shift = (nr4->lfsr_config >> 4) + 1;
+     uint32_t period;
 
      if (div == 0) {
-          nr4->counter = 4;
+          period = 4;
      } else {
-          nr4->counter = 8 * div;
+          period = 8 * div;
+     }
+
+     return period << shift;
+}
+
+static void gb_spu_lfsr_counter_reload(struct gb_spu_nr4 *nr4) {
+     nr4->counter = gb_spu_lfsr_period(nr4);
+}
+
+static uint16_t gb_spu_lfsr_next(uint16_t lfsr, bool period_7bits) {
+     uint16_t shifted;
+     uint16_t carry;
+
+     shifted = lfsr >> 1;
+     carry = (lfsr ^ shifted) & 1;
+
+     lfsr = shifted;
+     lfsr |= carry << 14;
+
+     if (period_7bits) {
+          /* Carry is also copied to bit 6 */
+          lfsr &= ~(1U << 6);
+          lfsr |= carry << 6;
      }
 
-     nr4->counter <<= shift;
+     return lfsr;
+}
+
+/* Apply an LFSR jump matrix */
+static uint16_t gb_spu_lfsr_apply(const uint16_t jump[15], uint16_t lfsr) {
+     uint16_t r = 0;
+     unsigned bit;
+
+     for (bit = 0; bit < 15; bit++) {
+          if (lfsr & (1U << bit)) {
+               r ^= jump[bit];
+          }
+     }
+
+     return r;
+}
+
+/* LFSR transitions used to skip steps while the SPU is muted, for the 15 and
+ * 7 bit modes. The LFSR is linear so each jump is a 15x15 matrix over GF(2),
+ * stored as the image of each bit. The tables are the same for every
+ * instance so they're only built once. */
+static uint16_t gb_spu_lfsr_jump[2][GB_SPU_LFSR_JUMPS][15];
+static pthread_once_t gb_spu_lfsr_jump_once = PTHREAD_ONCE_INIT;
+
+static void gb_spu_lfsr_init_jumps(void) {
+     unsigned mode;
+
+     for (mode = 0; mode < 2; mode++) {
+          uint16_t (*jump)[15] = gb_spu_lfsr_jump[mode];
+          unsigned bit;
+          unsigned i;
+
+          /* One step */
+          for (bit = 0; bit < 15; bit++) {
+               jump[0][bit] = gb_spu_lfsr_next(1U << bit, mode);
+          }
+
+          /* Each jump is the previous one applied twice */
+          for (i = 1; i < GB_SPU_LFSR_JUMPS; i++) {
+               for (bit = 0; bit < 15; bit++) {
+                    jump[i][bit] = gb_spu_lfsr_apply(jump[i - 1],
+                                                     jump[i - 1][bit]);
+               }
+          }
+     }
 }
 
 void gb_spu_sweep_reload(struct gb_spu_sweep *f, uint8_t conf) {
@@ -68,6 +145,8 @@ void gb_spu_sweep_reload(struct gb_spu_sweep *f, uint8_t conf) {
 void gb_spu_reset(struct gb *gb) {
      struct gb_spu *spu = &gb->spu;
 
+     gb_sync_register(gb, GB_SYNC_SPU, gb_spu_sync);
+
      spu->enable = true;
      spu->output_level = 0;
      spu->sound_mux = 0;
@@ -111,6 +190,7 @@ void gb_spu_reset(struct gb *gb) {
      spu->nr4.envelope_config = 0;
      spu->nr4.lfsr_config = 0;
      spu->nr4.lfsr = 0x7fff;
+     pthread_once(&gb_spu_lfsr_jump_once, gb_spu_lfsr_init_jumps);
 }
 
 void gb_spu_duration_reload(struct gb_spu_duration *d,
@@ -151,104 +231,79 @@ static bool gb_spu_duration_update(struct gb_spu_duration *d,
 /* Update the frequency counter and return the number of times it ran out */
 static unsigned gb_spu_frequency_update(struct gb_spu_divider *f,
                                         unsigned cycles) {
-     unsigned count = 0;
+     unsigned period;
+     unsigned count;
 
-     while (cycles) {
-          if (f->counter > cycles) {
-               f->counter -= cycles;
-               cycles = 0;
-          } else {
-               count++;
-               cycles -= f->counter;
-               /* Reload counter */
-               gb_spu_frequency_reload(f);
-          }
+     if (f->counter > cycles) {
+          f->counter -= cycles;
+          return 0;
      }
 
+     /* The counter runs out at least once, after that it's reloaded with the
+      * same period every time */
+     period = gb_spu_frequency_period(f);
+     cycles -= f->counter;
+
+     count = 1 + cycles / period;
+     f->counter = period - cycles % period;
+
      return count;
 }
 
-/* Update the sweep function and the frequency counter and return the number of
- * times it ran out */
-static unsigned gb_spu_sweep_update(struct gb_spu_sweep *s,
-                                    unsigned cycles,
-                                    bool *disable) {
-     unsigned count = 0;
-     *disable = false;
+/* Run the sweep function for `cycles`, which must not go past the next sweep
+ * step. Returns true if the frequency overflowed and the sound must be
+ * disabled. */
+static bool gb_spu_sweep_update(struct gb_spu_sweep *s, unsigned cycles) {
+     uint16_t delta;
 
      if (s->time == 0) {
           /* Sweep is disabled */
-          return gb_spu_frequency_update(&s->divider, cycles);
+          return false;
      }
 
-     /* We need to step the sweep function and the frequency function alongside
-      * since the frequency changes with the sweep */
-     while (cycles) {
-          unsigned to_run = cycles;
-
-          if (s->counter < to_run) {
-               to_run = s->counter;
-          }
-
-          if (s->divider.counter < to_run) {
-               to_run = s->divider.counter;
-          }
+     s->counter -= cycles;
+     if (s->counter != 0) {
+          return false;
+     }
 
-          s->counter -= to_run;
-          if (s->counter == 0) {
-               /* Sweep step elapsed */
-               uint16_t delta = s->divider.offset >> s->shift;
+     /* Sweep step elapsed, reload counter */
+     s->counter = 0x8000 * s->time;
 
-               if (s->subtract) {
-                    /* If we're subtracting and the shift value is zero or it
-                     * would overflow we do nothing and the divider offset is
-                     * not changed */
-                    if (s->shift != 0 && delta <= s->divider.offset) {
-                         s->divider.offset -= delta;
-                    }
-               } else {
-                    uint32_t o = s->divider.offset;
+     delta = s->divider.offset >> s->shift;
 
-                    o += delta;
-
-                    if (o > 0x7ff) {
-                         /* If the addition overflows the sound is disabled */
-                         *disable = true;
-                         break;
-                    }
+     if (s->subtract) {
+          /* If we're subtracting and the shift value is zero or it would
+           * overflow we do nothing and the divider offset is not changed */
+          if (s->shift != 0 && delta <= s->divider.offset) {
+               s->divider.offset -= delta;
+          }
+     } else {
+          uint32_t o = s->divider.offset;
 
-                    s->divider.offset = o;
-               }
+          o += delta;
 
-               /* Reload counter */
-               s->counter = 0x8000 * s->time;
+          if (o > 0x7ff) {
+               /* If the addition overflows the sound is disabled */
+               return true;
           }
 
-          count += gb_spu_frequency_update(&s->divider, to_run);
-          cycles -= to_run;
+          s->divider.offset = o;
      }
 
-     return count;
+     return false;
 }
 
 #define GB_SPU_NPHASES 16
-static uint8_t gb_spu_next_wave_sample(struct gb_spu_rectangle_wave *wave,
-                                       unsigned phase_steps) {
-     static const uint8_t waveforms[4][GB_SPU_NPHASES / 2] = {
-          /* 1/8 */
-          { 1, 0, 0, 0, 0, 0, 0, 0},
-          /* 1/4 */
-          { 1, 1, 0, 0, 0, 0, 0, 0},
-          /* 1/2 */
-          { 1, 1, 1, 1, 0, 0, 0, 0},
-          /* 3/4 */
-          { 1, 1, 1, 1, 1, 1, 0, 0},
-     };
-
-     wave->phase = (wave->phase + phase_steps) % GB_SPU_NPHASES;
-
-     return waveforms[wave->duty_cycle][wave->phase / 2];
-}
+static const uint8_t gb_spu_waveforms[4][GB_SPU_NPHASES / 2] = {
+     /* 1/8 */
+     { 1, 0, 0, 0, 0, 0, 0, 0},
+     /* 1/4 */
+     { 1, 1, 0, 0, 0, 0, 0, 0},
+     /* 1/2 */
+     { 1, 1, 1, 1, 0, 0, 0, 0},
+     /* 3/4 */
+     { 1, 1, 1, 1, 1, 1, 0, 0},
+};
 
 static void gb_spu_envelope_reload_counter(struct gb_spu_envelope *e) {
      e->counter = e->step_duration * 0x10000;
@@ -298,256 +353,876 @@ static bool gb_spu_envelope_update(struct gb_spu_envelope *e, unsigned cycles) {
      return !gb_spu_envelope_active(e);
 }
 
-static uint8_t gb_spu_next_nr1_sample(struct gb *gb, unsigned cycles) {
+static void gb_spu_lfsr_step(struct gb_spu_nr4 *nr4) {
+     /* If true the lfsr only uses 7 bits for the effective register period */
+     bool period_7bits = nr4->lfsr_config & 0x8;
+
+     nr4->lfsr = gb_spu_lfsr_next(nr4->lfsr, period_7bits);
+}
+
+/* Build the band-limited step kernel: a windowed sinc for each sub-sample
+ * position of the step */
+static void gb_spu_blip_init(struct gb_spu_blip *blip) {
+     /* Cut off a bit below the Nyquist frequency */
+     const double cutoff = 0.9;
+     const double half = GB_SPU_BLIP_TAPS / 2;
+     unsigned phase;
+
+     for (phase = 0; phase < GB_SPU_BLIP_PHASES; phase++) {
+          double frac = (double)phase / GB_SPU_BLIP_PHASES;
+          double taps[GB_SPU_BLIP_TAPS];
+          double sum = 0;
+          int32_t total = 0;
+          unsigned center = GB_SPU_BLIP_TAPS / 2 - 1;
+          unsigned k;
+
+          for (k = 0; k < GB_SPU_BLIP_TAPS; k++) {
+               /* Distance between the output sample and the step */
+               double x = (double)k - (half - 1) - frac;
+               double sinc = 1;
+               double window;
+
+               if (x != 0) {
+                    sinc = sin(M_PI * cutoff * x) / (M_PI * cutoff * x);
+               }
+
+               /* Blackman window */
+               window = 0.42 + 0.5 * cos(M_PI * x / half) +
+                    0.08 * cos(2 * M_PI * x / half);
+
+               taps[k] = sinc * window;
+               sum += taps[k];
+          }
+
+          for (k = 0; k < GB_SPU_BLIP_TAPS; k++) {
+               blip->kernel[phase][k] = lround(taps[k] / sum * 0x8000);
+               total += blip->kernel[phase][k];
+          }
+
+          /* Make sure that the taps add up exactly, otherwise the output
+           * would drift */
+          blip->kernel[phase][center] += 0x8000 - total;
+     }
+
+     memset(blip->deltas, 0, sizeof(blip->deltas));
+     blip->level[0] = 0;
+     blip->level[1] = 0;
+     blip->pos = 0;
+     blip->sample_cycles = 0;
+}
+
+/* Add a band-limited step of `delta_l`/`delta_r` at cycle `t` of the current
+ * sync */
+static void gb_spu_blip_add(struct gb_spu_blip *blip, uint32_t t,
+                            int32_t delta_l, int32_t delta_r) {
+     uint64_t pos = blip->pos + t * blip->factor;
+     unsigned phase = (pos >> (32 - GB_SPU_BLIP_PHASE_BITS)) &
+          (GB_SPU_BLIP_PHASES - 1);
+     const int16_t *kernel = blip->kernel[phase];
+     int32_t (*d)[2] = blip->deltas + (pos >> 32);
+     int32_t sum_l = 0;
+     int32_t sum_r = 0;
+     unsigned k;
+
+     for (k = 0; k < GB_SPU_BLIP_TAPS; k++) {
+          int32_t l = (delta_l * kernel[k]) >> 15;
+          int32_t r = (delta_r * kernel[k]) >> 15;
+
+          d[k][0] += l;
+          d[k][1] += r;
+          sum_l += l;
+          sum_r += r;
+     }
+
+     /* Put the rounding errors in the center tap so that the step has
+      * exactly the right height */
+     d[GB_SPU_BLIP_TAPS / 2 - 1][0] += delta_l - sum_l;
+     d[GB_SPU_BLIP_TAPS / 2 - 1][1] += delta_r - sum_r;
+}
+
+/* True if the SPU doesn't produce any audio */
+static bool gb_spu_muted(const struct gb_spu *spu) {
+     return spu->mute || spu->blip.sample_rate == 0;
+}
+
+/* True if a waveform repeating every `period` cycles is above the Nyquist
+ * frequency of the output */
+static bool gb_spu_above_nyquist(const struct gb_spu *spu, uint32_t period) {
+     return period < 2 * spu->blip.sample_cycles;
+}
+
+/* Set the output level of `sound` at cycle `t` of the current sync. `level`
+ * has GB_SPU_LEVEL_SHIFT fractional bits. */
+static void gb_spu_set_level(struct gb *gb, unsigned sound, uint32_t t,
+                             unsigned level) {
      struct gb_spu *spu = &gb->spu;
-     uint8_t sample;
-     unsigned sound_cycles;
-     bool disable;
+     int32_t *out = spu->sound_output[sound];
+     int32_t l = (level * spu->sound_amp[sound][0]) >> GB_SPU_LEVEL_SHIFT;
+     int32_t r = (level * spu->sound_amp[sound][1]) >> GB_SPU_LEVEL_SHIFT;
 
-     /* The duration counter runs even if the sound itself is not running */
-     if (gb_spu_duration_update(&spu->nr1.duration,
-                                GB_SPU_NR1_T1_MAX,
-                                cycles)) {
-          spu->nr1.running = false;
+     if (gb_spu_muted(spu)) {
+          /* The output will be reconciled at the first sync once we're
+           * unmuted */
+          return;
      }
 
-     if (!spu->nr1.running) {
-          return 0;
+     if (l == out[0] && r == out[1]) {
+          return;
      }
 
-     if (gb_spu_envelope_update(&spu->nr1.envelope, cycles)) {
-          spu->nr1.running = false;
+     gb_spu_blip_add(&spu->blip, t, l - out[0], r - out[1]);
+
+     out[0] = l;
+     out[1] = r;
+}
+
+/* Level of a rectangular wave. If it's too high pitched to be reproduced at
+ * the output sample rate we use its average level instead. */
+static unsigned gb_spu_rectangle_level(const struct gb_spu *spu,
+                                       const struct gb_spu_rectangle_wave *wave,
+                                       const struct gb_spu_divider *divider,
+                                       uint8_t volume) {
+     const uint8_t *waveform = gb_spu_waveforms[wave->duty_cycle];
+     uint32_t period = gb_spu_frequency_period(divider);
+     unsigned sum = 0;
+     unsigned i;
+
+     if (!gb_spu_above_nyquist(spu, GB_SPU_NPHASES * period)) {
+          return (waveform[wave->phase / 2] * volume) << GB_SPU_LEVEL_SHIFT;
      }
 
-     if (!spu->nr1.running) {
-          return 0;
+     for (i = 0; i < GB_SPU_NPHASES / 2; i++) {
+          sum += waveform[i];
      }
 
-     sound_cycles = gb_spu_sweep_update(&spu->nr1.sweep, cycles, &disable);
-     if (disable) {
-          spu->nr1.running = false;
+     return ((sum * volume) << GB_SPU_LEVEL_SHIFT) / (GB_SPU_NPHASES / 2);
+}
+
+static unsigned gb_spu_nr1_level(struct gb_spu *spu) {
+     const struct gb_spu_nr1 *nr1 = &spu->nr1;
+
+     if (!nr1->running) {
           return 0;
      }
 
-     sample = gb_spu_next_wave_sample(&spu->nr1.wave, sound_cycles);
+     return gb_spu_rectangle_level(spu, &nr1->wave, &nr1->sweep.divider,
+                                   nr1->envelope.value);
+}
+
+static unsigned gb_spu_nr2_level(struct gb_spu *spu) {
+     const struct gb_spu_nr2 *nr2 = &spu->nr2;
 
-     sample *= spu->nr1.envelope.value;
+     if (!nr2->running) {
+          return 0;
+     }
 
-     return sample;
+     return gb_spu_rectangle_level(spu, &nr2->wave, &nr2->divider,
+                                   nr2->envelope.value);
 }
 
-static uint8_t gb_spu_next_nr2_sample(struct gb *gb, unsigned cycles) {
-     struct gb_spu *spu = &gb->spu;
-     uint8_t sample;
-     unsigned sound_cycles;
+/* Sound 3 sample at `index` in the RAM */
+static unsigned gb_spu_nr3_sample(const struct gb_spu_nr3 *nr3,
+                                  unsigned index) {
+     /* We pack two samples per byte */
+     uint8_t sample = nr3->ram[index / 2];
 
-     /* The duration counter runs even if the sound itself is not running */
-     if (gb_spu_duration_update(&spu->nr2.duration,
-                                GB_SPU_NR2_T1_MAX,
-                                cycles)) {
-          spu->nr2.running = false;
+     if (index & 1) {
+          sample &= 0xf;
+     } else {
+          sample >>= 4;
      }
 
-     if (!spu->nr2.running) {
+     return sample >> (nr3->volume_shift - 1);
+}
+
+static unsigned gb_spu_nr3_level(struct gb_spu *spu) {
+     const struct gb_spu_nr3 *nr3 = &spu->nr3;
+     unsigned nsamples = GB_NR3_RAM_SIZE * 2;
+     unsigned sum = 0;
+     unsigned i;
+
+     if (!nr3->running || nr3->volume_shift == 0) {
+          /* Sound is stopped or muted */
           return 0;
      }
 
-     if (gb_spu_envelope_update(&spu->nr2.envelope, cycles)) {
-          spu->nr2.running = false;
+     if (!gb_spu_above_nyquist(spu, nsamples *
+                               gb_spu_frequency_period(&nr3->divider))) {
+          return gb_spu_nr3_sample(nr3, nr3->index) << GB_SPU_LEVEL_SHIFT;
+     }
+
+     /* Too high pitched, use the average of the waveform */
+     for (i = 0; i < nsamples; i++) {
+          sum += gb_spu_nr3_sample(nr3, i);
      }
 
-     if (!spu->nr2.running) {
+     return (sum << GB_SPU_LEVEL_SHIFT) / nsamples;
+}
+
+static unsigned gb_spu_nr4_level(struct gb_spu *spu) {
+     const struct gb_spu_nr4 *nr4 = &spu->nr4;
+
+     if (!nr4->running) {
           return 0;
      }
 
-     sound_cycles = gb_spu_frequency_update(&spu->nr2.divider, cycles);
+     /* Sample is 0 if the LFSR's LSB is 0, otherwise it's the envelope's value
+      */
+     return ((nr4->lfsr & 1) * nr4->envelope.value) << GB_SPU_LEVEL_SHIFT;
+}
+
+/* Limit `run` to the number of cycles before `counter` runs out */
+static uint32_t gb_spu_run_limit(uint32_t counter, uint32_t run) {
+     if (counter != 0 && counter < run) {
+          return counter;
+     }
+
+     return run;
+}
 
-     sample = gb_spu_next_wave_sample(&spu->nr2.wave, sound_cycles);
+/* Run a rectangular wave with a constant frequency and volume for `cycles`
+ * starting at cycle `t`. We jump from one level change to the next instead of
+ * stepping through every phase. */
+static void gb_spu_run_rectangle(struct gb *gb, unsigned sound,
+                                 struct gb_spu_rectangle_wave *wave,
+                                 struct gb_spu_divider *divider,
+                                 uint8_t volume,
+                                 uint32_t t,
+                                 uint32_t cycles) {
+     const uint8_t *waveform = gb_spu_waveforms[wave->duty_cycle];
+     uint32_t period = gb_spu_frequency_period(divider);
+     unsigned steps;
+
+     /* If we're muted or the volume is 0 we only advance the phase. Above
+      * the Nyquist frequency the output is the average level, set by the
+      * caller. */
+     while (volume != 0 && !gb_spu_muted(&gb->spu) &&
+            !gb_spu_above_nyquist(&gb->spu, GB_SPU_NPHASES * period)) {
+          uint8_t cur = waveform[wave->phase / 2];
+          uint32_t delay;
+
+          /* Number of phase steps until the level changes */
+          steps = 1;
+          while (waveform[((wave->phase + steps) % GB_SPU_NPHASES) / 2] == cur) {
+               steps++;
+          }
 
-     sample *= spu->nr2.envelope.value;
+          delay = divider->counter + (steps - 1) * period;
+          if (delay > cycles) {
+               break;
+          }
 
-     return sample;
+          t += delay;
+          cycles -= delay;
+          wave->phase = (wave->phase + steps) % GB_SPU_NPHASES;
+          divider->counter = period;
+
+          gb_spu_set_level(gb, sound, t,
+                           (waveform[wave->phase / 2] * volume) <<
+                           GB_SPU_LEVEL_SHIFT);
+     }
+
+     steps = gb_spu_frequency_update(divider, cycles);
+     wave->phase = (wave->phase + steps) % GB_SPU_NPHASES;
 }
 
-static uint8_t gb_spu_next_nr3_sample(struct gb *gb, unsigned cycles) {
+static void gb_spu_run_nr1(struct gb *gb, uint32_t cycles) {
      struct gb_spu *spu = &gb->spu;
-     uint8_t sample;
-     unsigned sound_cycles;
+     struct gb_spu_nr1 *nr1 = &spu->nr1;
+     uint32_t t = 0;
 
-     /* The duration counter runs even if the sound itself is not running */
-     if (gb_spu_duration_update(&spu->nr3.duration,
-                                GB_SPU_NR3_T1_MAX,
-                                cycles)) {
-          spu->nr3.running = false;
-     }
+     while (cycles) {
+          uint32_t run = cycles;
 
-     if (!spu->nr3.running) {
-          return 0;
+          /* Run until the next length, envelope or sweep step */
+          if (nr1->duration.enable) {
+               run = gb_spu_run_limit(nr1->duration.counter, run);
+          }
+
+          if (nr1->running) {
+               if (nr1->envelope.step_duration != 0) {
+                    run = gb_spu_run_limit(nr1->envelope.counter, run);
+               }
+               if (nr1->sweep.time != 0) {
+                    run = gb_spu_run_limit(nr1->sweep.counter, run);
+               }
+
+               gb_spu_run_rectangle(gb, 0, &nr1->wave, &nr1->sweep.divider,
+                                    nr1->envelope.value, t, run);
+          }
+
+          t += run;
+          cycles -= run;
+
+          /* The duration counter runs even if the sound itself is not
+           * running */
+          if (gb_spu_duration_update(&nr1->duration, GB_SPU_NR1_T1_MAX, run)) {
+               nr1->running = false;
+          }
+
+          if (nr1->running &&
+              gb_spu_envelope_update(&nr1->envelope, run)) {
+               nr1->running = false;
+          }
+
+          if (nr1->running &&
+              gb_spu_sweep_update(&nr1->sweep, run)) {
+               nr1->running = false;
+          }
+
+          gb_spu_set_level(gb, 0, t, gb_spu_nr1_level(spu));
      }
+}
 
-     sound_cycles = gb_spu_frequency_update(&spu->nr3.divider, cycles);
+static void gb_spu_run_nr2(struct gb *gb, uint32_t cycles) {
+     struct gb_spu *spu = &gb->spu;
+     struct gb_spu_nr2 *nr2 = &spu->nr2;
+     uint32_t t = 0;
 
-     spu->nr3.index = (spu->nr3.index + sound_cycles) % (GB_NR3_RAM_SIZE * 2);
+     while (cycles) {
+          uint32_t run = cycles;
 
-     if (spu->nr3.volume_shift == 0) {
-          /* Sound is muted */
-          return 0;
+          /* Run until the next length or envelope step */
+          if (nr2->duration.enable) {
+               run = gb_spu_run_limit(nr2->duration.counter, run);
+          }
+
+          if (nr2->running) {
+               if (nr2->envelope.step_duration != 0) {
+                    run = gb_spu_run_limit(nr2->envelope.counter, run);
+               }
+
+               gb_spu_run_rectangle(gb, 1, &nr2->wave, &nr2->divider,
+                                    nr2->envelope.value, t, run);
+          }
+
+          t += run;
+          cycles -= run;
+
+          if (gb_spu_duration_update(&nr2->duration, GB_SPU_NR2_T1_MAX, run)) {
+               nr2->running = false;
+          }
+
+          if (nr2->running &&
+              gb_spu_envelope_update(&nr2->envelope, run)) {
+               nr2->running = false;
+          }
+
+          gb_spu_set_level(gb, 1, t, gb_spu_nr2_level(spu));
      }
+}
 
-     /* We pack two samples per byte */
-     sample = spu->nr3.ram[spu->nr3.index / 2];
+/* Run sound 3's waveform for `cycles` starting at cycle `t`, jumping from one
+ * level change to the next */
+static void gb_spu_run_wave(struct gb *gb, uint32_t t, uint32_t cycles) {
+     struct gb_spu_nr3 *nr3 = &gb->spu.nr3;
+     uint32_t period = gb_spu_frequency_period(&nr3->divider);
+     unsigned nsamples = GB_NR3_RAM_SIZE * 2;
+     unsigned steps;
+
+     /* If we're muted or the volume is 0 we only advance the index. Above
+      * the Nyquist frequency the output is the average level, set by the
+      * caller. */
+     while (nr3->volume_shift != 0 && !gb_spu_muted(&gb->spu) &&
+            !gb_spu_above_nyquist(&gb->spu, nsamples * period)) {
+          unsigned cur = gb_spu_nr3_sample(nr3, nr3->index);
+          uint32_t delay;
+
+          /* Number of steps until the level changes */
+          steps = 1;
+          while (steps < nsamples &&
+                 gb_spu_nr3_sample(nr3, (nr3->index + steps) % nsamples) ==
+                 cur) {
+               steps++;
+          }
 
-     if (spu->nr3.index & 1) {
-          sample &= 0xf;
-     } else {
-          sample >>= 4;
+          if (steps == nsamples) {
+               /* Flat waveform */
+               break;
+          }
+
+          delay = nr3->divider.counter + (steps - 1) * period;
+          if (delay > cycles) {
+               break;
+          }
+
+          t += delay;
+          cycles -= delay;
+          nr3->index = (nr3->index + steps) % nsamples;
+          nr3->divider.counter = period;
+
+          gb_spu_set_level(gb, 2, t,
+                           gb_spu_nr3_sample(nr3, nr3->index) <<
+                           GB_SPU_LEVEL_SHIFT);
      }
 
-     return sample >> (spu->nr3.volume_shift - 1);
+     steps = gb_spu_frequency_update(&nr3->divider, cycles);
+     nr3->index = (nr3->index + steps) % nsamples;
 }
 
-static void gb_spu_lfsr_step(struct gb_spu_nr4 *nr4) {
-     /* If true the lfsr only uses 7 bits for the effective register period */
-     bool period_7bits = nr4->lfsr_config & 0x8;
-     uint16_t shifted;
-     uint16_t carry;
+static void gb_spu_run_nr3(struct gb *gb, uint32_t cycles) {
+     struct gb_spu *spu = &gb->spu;
+     struct gb_spu_nr3 *nr3 = &spu->nr3;
+     uint32_t t = 0;
 
-     shifted = nr4->lfsr >> 1;
-     carry = (nr4->lfsr ^ shifted) & 1;
+     while (cycles) {
+          uint32_t run = cycles;
 
-     nr4->lfsr = shifted;
-     nr4->lfsr |= carry << 14;
+          /* Run until the next length step */
+          if (nr3->duration.enable) {
+               run = gb_spu_run_limit(nr3->duration.counter, run);
+          }
 
-     if (period_7bits) {
-          /* Carry is also copied to bit 6 */
-          nr4->lfsr &= ~(1U << 6);
-          nr4->lfsr |= carry << 6;
+          if (nr3->running) {
+               gb_spu_run_wave(gb, t, run);
+          }
+
+          t += run;
+          cycles -= run;
+
+          if (gb_spu_duration_update(&nr3->duration, GB_SPU_NR3_T1_MAX, run)) {
+               nr3->running = false;
+          }
+
+          gb_spu_set_level(gb, 2, t, gb_spu_nr3_level(spu));
      }
 }
 
-static uint8_t gb_spu_next_nr4_sample(struct gb *gb, unsigned cycles) {
-     struct gb_spu *spu = &gb->spu;
-     uint8_t sample;
+/* Advance sound 4's LFSR by `cycles` without producing any output */
+static void gb_spu_advance_noise(struct gb_spu_nr4 *nr4, uint32_t cycles) {
+     bool period_7bits = nr4->lfsr_config & 0x8;
+     const uint16_t (*jump)[15] = gb_spu_lfsr_jump[period_7bits];
+     uint32_t period;
+     uint32_t steps;
+     unsigned i;
 
-     /* The duration counter runs even if the sound itself is not running */
-     if (gb_spu_duration_update(&spu->nr4.duration,
-                                GB_SPU_NR4_T1_MAX,
-                                cycles)) {
-          spu->nr4.running = false;
+     if (nr4->counter > cycles) {
+          nr4->counter -= cycles;
+          return;
      }
 
-     if (!spu->nr4.running) {
-          return 0;
+     /* Same as the frequency divider: the counter runs out at least once,
+      * after that it's reloaded with the same period every time */
+     cycles -= nr4->counter;
+     gb_spu_lfsr_counter_reload(nr4);
+     period = nr4->counter;
+
+     steps = 1 + cycles / period;
+     nr4->counter = period - cycles % period;
+
+     for (i = 0; steps != 0; i++, steps >>= 1) {
+          if (steps & 1) {
+               nr4->lfsr = gb_spu_lfsr_apply(jump[i], nr4->lfsr);
+          }
      }
+}
 
-     if (gb_spu_envelope_update(&spu->nr4.envelope, cycles)) {
-          spu->nr4.running = false;
+/* Run sound 4's LFSR at a constant volume for `cycles` starting at cycle
+ * `t` */
+static void gb_spu_run_noise(struct gb *gb, uint8_t volume,
+                             uint32_t t, uint32_t cycles) {
+     struct gb_spu_nr4 *nr4 = &gb->spu.nr4;
+     uint32_t sample_cycles = gb->spu.blip.sample_cycles;
+     /* If the LFSR shifts more than once per output sample we only output
+      * the average level over each output sample instead of every shift */
+     bool average = gb_spu_lfsr_period(nr4) < sample_cycles;
+     uint32_t start = t;
+     unsigned sum = 0;
+     unsigned count = 0;
+
+     if (gb_spu_muted(&gb->spu)) {
+          gb_spu_advance_noise(nr4, cycles);
+          return;
      }
 
-     if (!spu->nr4.running) {
-          return 0;
+     while (nr4->counter <= cycles) {
+          unsigned level;
+
+          t += nr4->counter;
+          cycles -= nr4->counter;
+
+          gb_spu_lfsr_counter_reload(nr4);
+          gb_spu_lfsr_step(nr4);
+
+          level = ((nr4->lfsr & 1) * volume) << GB_SPU_LEVEL_SHIFT;
+          if (!average) {
+               gb_spu_set_level(gb, 3, t, level);
+               continue;
+          }
+
+          sum += level;
+          count++;
+          if (t - start >= sample_cycles) {
+               gb_spu_set_level(gb, 3, t, sum / count);
+               start = t;
+               sum = 0;
+               count = 0;
+          }
      }
 
+     nr4->counter -= cycles;
+}
+
+static void gb_spu_run_nr4(struct gb *gb, uint32_t cycles) {
+     struct gb_spu *spu = &gb->spu;
+     struct gb_spu_nr4 *nr4 = &spu->nr4;
+     uint32_t t = 0;
+
      while (cycles) {
-          if (spu->nr4.counter > cycles) {
-               spu->nr4.counter -= cycles;
-               cycles = 0;
-          } else {
-               cycles -= spu->nr4.counter;
-               gb_spu_lfsr_counter_reload(&spu->nr4);
-               gb_spu_lfsr_step(&spu->nr4);
+          uint32_t run = cycles;
+
+          /* Run until the next length or envelope step */
+          if (nr4->duration.enable) {
+               run = gb_spu_run_limit(nr4->duration.counter, run);
+          }
+
+          if (nr4->running) {
+               if (!gb_spu_envelope_active(&nr4->envelope)) {
+                    /* Started with a muted envelope */
+                    nr4->running = false;
+                    gb_spu_set_level(gb, 3, t, 0);
+                    continue;
+               }
+
+               if (nr4->envelope.step_duration != 0) {
+                    run = gb_spu_run_limit(nr4->envelope.counter, run);
+               }
+
+               gb_spu_run_noise(gb, nr4->envelope.value, t, run);
+          }
+
+          t += run;
+          cycles -= run;
+
+          if (gb_spu_duration_update(&nr4->duration, GB_SPU_NR4_T1_MAX, run)) {
+               nr4->running = false;
           }
+
+          if (nr4->running &&
+              gb_spu_envelope_update(&nr4->envelope, run)) {
+               nr4->running = false;
+          }
+
+          gb_spu_set_level(gb, 3, t, gb_spu_nr4_level(spu));
      }
+}
 
-     /* Sample is 0 if the LFSR's LSB is 0, otherwise it's the envelope's value
-      */
-     sample = spu->nr4.lfsr & 1;
-     sample *= spu->nr4.envelope.value;
+void gb_spu_ring_init(struct gb *gb,
+                      unsigned sample_rate_hz,
+                      unsigned latency_ms) {
+     struct gb_spu_ring *ring = &gb->spu.ring;
+     unsigned capacity;
+     unsigned i;
+
+     if (sample_rate_hz == 0 || sample_rate_hz > GB_SPU_MAX_SAMPLE_RATE_HZ) {
+          fprintf(stderr, "Unsupported audio sample rate %uHz\n",
+                  sample_rate_hz);
+          die();
+     }
+
+     gb->spu.blip.sample_rate = sample_rate_hz;
+     gb_spu_blip_init(&gb->spu.blip);
+
+     /* Start from the current output of the sounds */
+     for (i = 0; i < 4; i++) {
+          gb->spu.blip.level[0] += gb->spu.sound_output[i][0];
+          gb->spu.blip.level[1] += gb->spu.sound_output[i][1];
+     }
+
+     capacity = (uint64_t)sample_rate_hz * latency_ms / 1000;
+     if (capacity < GB_SPU_BLIP_LENGTH) {
+          capacity = GB_SPU_BLIP_LENGTH;
+     }
 
-     return sample;
+     ring->capacity = capacity;
+     ring->size = 1;
+     while (ring->size < capacity) {
+          ring->size *= 2;
+     }
+
+     ring->samples = calloc(ring->size, sizeof(*ring->samples));
+     if (ring->samples == NULL) {
+          perror("calloc failed");
+          die();
+     }
+
+     atomic_init(&ring->head, 0);
+     atomic_init(&ring->tail, 0);
+     atomic_init(&ring->waiting, false);
+
+     if (sem_init(&ring->room, 0, 0)) {
+          perror("sem_init failed");
+          die();
+     }
+}
+
+void gb_spu_ring_destroy(struct gb *gb) {
+     struct gb_spu_ring *ring = &gb->spu.ring;
+
+     if (ring->samples == NULL) {
+          return;
+     }
+
+     sem_destroy(&ring->room);
+     free(ring->samples);
+     ring->samples = NULL;
+     gb->spu.blip.sample_rate = 0;
+}
+
+/* Number of frames waiting to be read from the ring */
+unsigned gb_spu_ring_fill(struct gb_spu_ring *ring) {
+     unsigned head = atomic_load_explicit(&ring->head, memory_order_acquire);
+     unsigned tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+
+     return head - tail;
+}
+
+/* Read up to `n` frames from the ring, returns the number of frames read. Must
+ * only be called by the consumer. */
+unsigned gb_spu_ring_read(struct gb_spu_ring *ring,
+                          int16_t (*samples)[2],
+                          unsigned n) {
+     unsigned tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+     unsigned head = atomic_load_explicit(&ring->head, memory_order_acquire);
+     unsigned pos = tail & (ring->size - 1);
+     unsigned chunk;
+
+     if (n > head - tail) {
+          n = head - tail;
+     }
+
+     /* The frames might wrap around the end of the ring */
+     chunk = ring->size - pos;
+     if (chunk > n) {
+          chunk = n;
+     }
+
+     memcpy(samples, ring->samples + pos, chunk * sizeof(*samples));
+     memcpy(samples + chunk, ring->samples, (n - chunk) * sizeof(*samples));
+
+     atomic_store(&ring->tail, tail + n);
+
+     if (atomic_exchange(&ring->waiting, false)) {
+          /* Wake the SPU up */
+          sem_post(&ring->room);
+     }
+
+     return n;
+}
+
+/* Drop all the frames waiting in the ring. Must only be called by the
+ * consumer, or while it's stopped. */
+void gb_spu_ring_clear(struct gb_spu_ring *ring) {
+     unsigned head = atomic_load_explicit(&ring->head, memory_order_acquire);
+
+     atomic_store(&ring->tail, head);
+
+     if (atomic_exchange(&ring->waiting, false)) {
+          /* Wake the SPU up */
+          sem_post(&ring->room);
+     }
+}
+
+/* Wait for the consumer to make room in the ring */
+static void gb_spu_ring_wait(struct gb_spu_ring *ring) {
+     unsigned head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+
+     atomic_store(&ring->waiting, true);
+
+     /* The consumer might have made room before it saw `waiting`. In this
+      * case it might still post `room` later, which only makes us check the
+      * ring again next time. */
+     if (head - atomic_load(&ring->tail) < ring->capacity) {
+          return;
+     }
+
+     sem_wait(&ring->room);
+}
+
+/* Write `n` frames to the ring. If it's full we wait for the consumer unless
+ * we're unthrottled, in which case the frames that don't fit are dropped. */
+static void gb_spu_ring_write(struct gb *gb,
+                              const int16_t (*samples)[2],
+                              unsigned n) {
+     struct gb_spu_ring *ring = &gb->spu.ring;
+
+     if (ring->samples == NULL) {
+          /* Nobody is listening */
+          return;
+     }
+
+     while (n) {
+          unsigned head = atomic_load_explicit(&ring->head,
+                                               memory_order_relaxed);
+          unsigned tail = atomic_load_explicit(&ring->tail,
+                                               memory_order_acquire);
+          unsigned pos = head & (ring->size - 1);
+          unsigned count = ring->capacity - (head - tail);
+          unsigned chunk;
+
+          if (count == 0) {
+               if (gb->spu.unthrottled) {
+                    return;
+               }
+
+               gb_spu_ring_wait(ring);
+               continue;
+          }
+
+          if (count > n) {
+               count = n;
+          }
+
+          chunk = ring->size - pos;
+          if (chunk > count) {
+               chunk = count;
+          }
+
+          memcpy(ring->samples + pos, samples, chunk * sizeof(*samples));
+          memcpy(ring->samples, samples + chunk,
+                 (count - chunk) * sizeof(*samples));
+
+          atomic_store_explicit(&ring->head, head + count,
+                                memory_order_release);
+
+          samples += count;
+          n -= count;
+     }
 }
 
-/* Send a pair of left/right samples to the frontend */
-static void gb_spu_send_sample_to_frontend(struct gb *gb,
-                                           int16_t sample_l, int16_t sample_r) {
+/* Rate control ratio between the nominal and the actual output sample rate,
+ * for a block of `n` output frames. We produce fewer frames when the ring is
+ * more than half full and more when it's less. The proportional term
+ * reacts to the fill level, the integral term converges to the ratio between
+ * the emulation and audio clocks so that the ring stays half full. */
+static uint32_t gb_spu_rate_control_step(struct gb *gb, unsigned n) {
      struct gb_spu *spu = &gb->spu;
-     struct gb_spu_sample_buffer *buf;
+     int64_t fill = gb_spu_ring_fill(&spu->ring);
+     int64_t capacity = spu->ring.capacity;
+     const int64_t max = (int64_t)GB_SPU_RATE_CONTROL_MAX_DELTA << 16;
+     int64_t error;
+     int64_t delta;
+
+     if (fill > capacity) {
+          fill = capacity;
+     }
 
-     buf = &spu->buffers[spu->buffer_index];
+     /* Fill level error between -1.0 and 1.0, 16 fractional bits */
+     error = ((2 * fill - capacity) << 16) / capacity;
+
+     spu->rate_integral += (error * n) >> 8;
+     if (spu->rate_integral > max) {
+          spu->rate_integral = max;
+     } else if (spu->rate_integral < -max) {
+          spu->rate_integral = -max;
+     }
 
-     if (spu->sample_index == 0) {
-          /* We're about to fill the first sample, make sure that the
-           * buffer is free. If it's not this will pause the thread until
-           * the frontend frees it, effectively synchronizing us with audio
-           */
-          sem_wait(&buf->free);
+     delta = (spu->rate_integral >> 16) +
+          ((GB_SPU_RATE_CONTROL_MAX_DELTA / 2) * error >> 16);
+     if (delta > GB_SPU_RATE_CONTROL_MAX_DELTA) {
+          delta = GB_SPU_RATE_CONTROL_MAX_DELTA;
+     } else if (delta < -(int64_t)GB_SPU_RATE_CONTROL_MAX_DELTA) {
+          delta = -(int64_t)GB_SPU_RATE_CONTROL_MAX_DELTA;
      }
 
-     buf->samples[spu->sample_index][0] = sample_l;
-     buf->samples[spu->sample_index][1] = sample_r;
+     return GB_SPU_RESAMPLE_ONE + delta;
+}
+
+/* Compute the output samples completed by the end of the current sync,
+ * `cycles` long, and send them to the frontend */
+static void gb_spu_blip_end(struct gb *gb, uint32_t cycles) {
+     struct gb_spu_blip *blip = &gb->spu.blip;
+     int16_t samples[GB_SPU_BLIP_LENGTH][2];
+     uint64_t end = blip->pos + cycles * blip->factor;
+     unsigned n = end >> 32;
+     unsigned i;
+
+     for (i = 0; i < n; i++) {
+          unsigned c;
+
+          for (c = 0; c < 2; c++) {
+               int32_t v;
+
+               blip->level[c] += blip->deltas[i][c];
 
-     spu->sample_index++;
-     if (spu->sample_index == GB_SPU_SAMPLE_BUFFER_LENGTH) {
-          /* We're done with this buffer */
-          sem_post(&buf->ready);
-          /* Move on to the next one */
-          spu->buffer_index = (spu->buffer_index + 1)
-               % GB_SPU_SAMPLE_BUFFER_COUNT;
-          spu->sample_index = 0;
+               v = blip->level[c];
+               if (v > INT16_MAX) {
+                    v = INT16_MAX;
+               } else if (v < INT16_MIN) {
+                    v = INT16_MIN;
+               }
+
+               samples[i][c] = v;
+          }
      }
+
+     /* Keep the tails of the steps overlapping the next samples */
+     memmove(blip->deltas, blip->deltas + n,
+             GB_SPU_BLIP_TAPS * sizeof(blip->deltas[0]));
+     memset(blip->deltas + GB_SPU_BLIP_TAPS, 0,
+            n * sizeof(blip->deltas[0]));
+
+     blip->pos = end & 0xffffffffU;
+
+     gb_spu_ring_write(gb, samples, n);
 }
 
 void gb_spu_sync(struct gb *gb) {
      struct gb_spu *spu = &gb->spu;
+     struct gb_spu_blip *blip = &spu->blip;
      int32_t elapsed = gb_sync_resync(gb, GB_SYNC_SPU);
-     int32_t frac;
-     int32_t nsamples;
-     int32_t next_sync;
 
-     frac = spu->sample_period_frac;
-     elapsed += frac;
+     if (gb_spu_muted(spu)) {
+          /* Nothing to synthesize, the sounds only advance their state so we
+           * can run the whole period at once */
+          if (elapsed > 0) {
+               gb_spu_run_nr1(gb, elapsed);
+               gb_spu_run_nr2(gb, elapsed);
+               gb_spu_run_nr3(gb, elapsed);
+               gb_spu_run_nr4(gb, elapsed);
+          }
 
-     nsamples = elapsed / GB_SPU_SAMPLE_RATE_DIVISOR;
+          gb_sync_next(gb, GB_SYNC_SPU, GB_SPU_SYNC_CYCLES);
+          return;
+     }
 
-     while (nsamples--) {
-          int32_t next_sample_delay = GB_SPU_SAMPLE_RATE_DIVISOR - frac;
-          unsigned sound;
-          int16_t sound_samples[4];
-          int16_t sample_l = 0;
-          int16_t sample_r = 0;
+     /* The registers may have changed the output of the sounds since the
+      * last sync */
+     gb_spu_set_level(gb, 0, 0, gb_spu_nr1_level(spu));
+     gb_spu_set_level(gb, 1, 0, gb_spu_nr2_level(spu));
+     gb_spu_set_level(gb, 2, 0, gb_spu_nr3_level(spu));
+     gb_spu_set_level(gb, 3, 0, gb_spu_nr4_level(spu));
 
-          sound_samples[0] = gb_spu_next_nr1_sample(gb, next_sample_delay);
-          sound_samples[1] = gb_spu_next_nr2_sample(gb, next_sample_delay);
-          sound_samples[2] = gb_spu_next_nr3_sample(gb, next_sample_delay);
-          sound_samples[3] = gb_spu_next_nr4_sample(gb, next_sample_delay);
+     while (elapsed > 0) {
+          uint32_t cycles = elapsed;
 
-          for (sound = 0; sound < 4; sound++) {
-               sample_l += sound_samples[sound] * spu->sound_amp[sound][0];
-               sample_r += sound_samples[sound] * spu->sound_amp[sound][1];
+          if (cycles > GB_SPU_SYNC_CYCLES) {
+               cycles = GB_SPU_SYNC_CYCLES;
           }
 
-          gb_spu_send_sample_to_frontend(gb, sample_l, sample_r);
+          blip->factor = ((uint64_t)blip->sample_rate << 32) / GB_CPU_FREQ_HZ;
 
-          frac = 0;
-     }
+          if (spu->rate_control) {
+               unsigned n = (cycles * blip->factor) >> 32;
 
-     /* See if we have any leftover fractional sample */
-     frac = elapsed % GB_SPU_SAMPLE_RATE_DIVISOR;
+               blip->factor = blip->factor * GB_SPU_RESAMPLE_ONE /
+                    gb_spu_rate_control_step(gb, n);
+          }
+
+          blip->sample_cycles = ((uint64_t)1 << 32) / blip->factor;
 
-     /* Advance the SPU state even if we don't want the sample yet in order to
-      * have the correct value for the `running` flags */
-     gb_spu_next_nr1_sample(gb, frac);
-     gb_spu_next_nr2_sample(gb, frac);
-     gb_spu_next_nr3_sample(gb, frac);
-     gb_spu_next_nr4_sample(gb, frac);
+          /* The sounds record their level changes as they run */
+          gb_spu_run_nr1(gb, cycles);
+          gb_spu_run_nr2(gb, cycles);
+          gb_spu_run_nr3(gb, cycles);
+          gb_spu_run_nr4(gb, cycles);
 
-     spu->sample_period_frac = frac;
+          gb_spu_blip_end(gb, cycles);
+
+          elapsed -= cycles;
+     }
 
-     /* Schedule a sync to fill the current buffer */
-     next_sync = (GB_SPU_SAMPLE_BUFFER_LENGTH - spu->sample_index) *
-          GB_SPU_SAMPLE_RATE_DIVISOR;
-     next_sync -= frac;
-     gb_sync_next(gb, GB_SYNC_SPU, next_sync);
+     gb_sync_next(gb, GB_SYNC_SPU, GB_SPU_SYNC_CYCLES);
 }
 
 void gb_spu_nr1_start(struct gb *gb) {
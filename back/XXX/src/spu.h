@@ -1,33 +1,79 @@
 #ifndef _SPU_H_
 #define _SPU_H_
 
-/* We don't want to generate SPU samples at 4.2MHz so we only generate a sample
- * every GB_SPU_SAMPLE_RATE_DIVISOR cycles */
-#define GB_SPU_SAMPLE_RATE_DIVISOR      64
+/* Max number of cycles emulated between two SPU syncs */
+#define GB_SPU_SYNC_CYCLES 16384
 
-/* Effective sample rate for the frontend */
-#define GB_SPU_SAMPLE_RATE_HZ (GB_CPU_FREQ_HZ / GB_SPU_SAMPLE_RATE_DIVISOR)
+/* Highest output sample rate supported */
+#define GB_SPU_MAX_SAMPLE_RATE_HZ 192000
 
-/* Number of sample frames bufferized. Each frame contains two samples for the
- * left and right stereo channels */
-#define GB_SPU_SAMPLE_BUFFER_LENGTH 2048
+/* Number of taps of the band-limited step kernel */
+#define GB_SPU_BLIP_TAPS 16
+/* Number of sub-sample positions of the band-limited step kernel, as a
+ * power of two */
+#define GB_SPU_BLIP_PHASE_BITS 5
+#define GB_SPU_BLIP_PHASES (1U << GB_SPU_BLIP_PHASE_BITS)
 
-/* Number of entries in the sample buffer ring */
-#define GB_SPU_SAMPLE_BUFFER_COUNT 2
+/* Sound levels are fixed point with 5 fractional bits so that the average of
+ * a 32 sample waveform is exact */
+#define GB_SPU_LEVEL_SHIFT 5
+
+/* Length of the band-limited delta buffer: enough for GB_SPU_SYNC_CYCLES at
+ * GB_SPU_MAX_SAMPLE_RATE_HZ with some margin, plus the kernel */
+#define GB_SPU_BLIP_LENGTH (GB_SPU_SYNC_CYCLES / 16 + GB_SPU_BLIP_TAPS + 1)
+
+/* Resampling ratios are fixed point with 16 fractional bits */
+#define GB_SPU_RESAMPLE_ONE 0x10000U
+/* Max deviation of the resampling ratio in rate control mode: 0.5% */
+#define GB_SPU_RATE_CONTROL_MAX_DELTA (GB_SPU_RESAMPLE_ONE / 200)
 
 /* Sound 3 RAM size in bytes */
 #define GB_NR3_RAM_SIZE  16
 
-struct gb_spu_sample_buffer {
-     /* Buffer of pairs of stereo samples */
-     int16_t samples[GB_SPU_SAMPLE_BUFFER_LENGTH][2];
-     /* Semaphore set to 1 when the frontend is done sending the audio buffer
-      * and reset to 0 when the SPU starts filling it with new samples. */
-     sem_t free;
-     /* Semaphore set to 1 when the SPU is done filling a buffer and it can be
-      * sent by the frontend. Set to 0 by the frontend when it starts sending
-      * the samples. */
-     sem_t ready;
+/* Number of precomputed LFSR jumps, jump `i` advances the LFSR by 2^i
+ * steps */
+#define GB_SPU_LFSR_JUMPS 32
+
+/* Band-limited synthesis buffer: the sounds record the changes of their
+ * output level at the exact cycle they happen as band-limited steps, which
+ * are integrated into output samples at the end of each sync */
+struct gb_spu_blip {
+     /* Output sample rate in Hz, 0 if the audio isn't consumed */
+     unsigned sample_rate;
+     /* Output samples per cycle, 32 fractional bits */
+     uint64_t factor;
+     /* Cycles per output sample, rounded down */
+     uint32_t sample_cycles;
+     /* Position of the start of the current sync relative to `deltas[0]`, in
+      * output samples with 32 fractional bits */
+     uint64_t pos;
+     /* Left and right output level changes */
+     int32_t deltas[GB_SPU_BLIP_LENGTH][2];
+     /* Current left and right output levels */
+     int32_t level[2];
+     /* Windowed sinc kernel for each sub-sample position, the taps of each
+      * phase add up to 0x8000 */
+     int16_t kernel[GB_SPU_BLIP_PHASES][GB_SPU_BLIP_TAPS];
+};
+
+/* Lock-free ring of stereo sample frames, written by the SPU and read by a
+ * single consumer (typically the frontend's audio thread) */
+struct gb_spu_ring {
+     /* Buffer of pairs of stereo samples, `size` frames long. NULL if nobody
+      * consumes the audio, in which case the samples are discarded. */
+     int16_t (*samples)[2];
+     /* Storage size in frames, a power of two */
+     unsigned size;
+     /* Max number of frames buffered, set from the latency */
+     unsigned capacity;
+     /* Free-running position of the next frame written by the SPU */
+     atomic_uint head;
+     /* Free-running position of the next frame read by the consumer */
+     atomic_uint tail;
+     /* True if the SPU waits for the consumer to make room in the ring */
+     atomic_bool waiting;
+     /* Posted by the consumer when it makes room while the SPU is waiting */
+     sem_t room;
 };
 
 /* Duration works the same for all 4 sounds but the max values are different */
@@ -160,10 +206,6 @@ struct gb_spu {
       * registers except for sound 3's RAM */
      bool enable;
 
-     /* Leftover cycles from the previous sync if it left a number of cycles
-      * less than GB_SPU_SAMPLE_RATE_DIVISOR */
-     uint8_t sample_period_frac;
-
      /* NR50 register */
      uint8_t output_level;
      /* NR51 register */
@@ -171,6 +213,8 @@ struct gb_spu {
 
      /* Amplification factor for each sound for both stereo channels */
      int16_t sound_amp[4][2];
+     /* Current contribution of each sound to both stereo channels */
+     int32_t sound_output[4][2];
 
      /* Sound 1 state */
      struct gb_spu_nr1 nr1;
@@ -181,12 +225,29 @@ struct gb_spu {
      /* Sound 4 state */
      struct gb_spu_nr4 nr4;
 
-     /* Audio buffer exchanged with the frontend */
-     struct gb_spu_sample_buffer buffers[GB_SPU_SAMPLE_BUFFER_COUNT];
-     /* Buffer being currently filled up with fresh samples */
-     unsigned buffer_index;
-     /* Position within the current buffer */
-     unsigned sample_index;
+     /* Band-limited synthesis buffer */
+     struct gb_spu_blip blip;
+     /* Audio ring shared with the frontend */
+     struct gb_spu_ring ring;
+     /* If true the SPU doesn't wait for the frontend to make room in the ring
+      * anymore, the samples that don't fit are dropped. Used to run faster
+      * than real time. Can be changed at any time. */
+     bool unthrottled;
+     /* If true no audio is produced: the sounds only advance their state
+      * (length counters, envelopes, sweep, LFSR and wave position) so that the
+      * registers stay correct. The SPU behaves the same way if there's no
+      * ring. Can be changed at any time. */
+     bool mute;
+     /* Set when the frontend paces the emulation itself (typically to the
+      * display refresh). The output sample rate is adjusted within
+      * GB_SPU_RATE_CONTROL_MAX_DELTA to keep the ring half full, so that the
+      * audio neither underruns nor drifts. The SPU only waits for
+      * the frontend if the ring fills up anyway. Can be changed at any
+      * time. */
+     bool rate_control;
+     /* Integral term of the rate control, in 1/65536th of resampling ratio
+      * units */
+     int64_t rate_integral;
 };
 
 void gb_spu_reset(struct gb *gb);
@@ -200,5 +261,14 @@ void gb_spu_duration_reload(struct gb_spu_duration *d,
                             unsigned duration_max,
                             uint8_t t1);
 void gb_spu_sweep_reload(struct gb_spu_sweep *f, uint8_t conf);
+void gb_spu_ring_init(struct gb *gb,
+                      unsigned sample_rate_hz,
+                      unsigned latency_ms);
+void gb_spu_ring_destroy(struct gb *gb);
+unsigned gb_spu_ring_fill(struct gb_spu_ring *ring);
+unsigned gb_spu_ring_read(struct gb_spu_ring *ring,
+                          int16_t (*samples)[2],
+                          unsigned n);
+void gb_spu_ring_clear(struct gb_spu_ring *ring);
 
 #endif /* _SPU_H_ */
@@ -8,12 +8,77 @@ void gb_sync_reset(struct gb *gb) {
      for (i = 0; i < GB_SYNC_NUM; i++) {
           sync->last_sync[i] = 0;
           sync->next_event[i] = 0;
+          /* All the dates are equal, any order is a valid heap */
+          sync->heap[i] = i;
+          sync->heap_pos[i] = i;
      }
 
      gb->timestamp = 0;
      sync->first_event = 0;
 }
 
+void gb_sync_register(struct gb *gb, enum gb_sync_token token,
+                      gb_sync_callback_f callback) {
+     gb->sync.callbacks[token] = callback;
+}
+
+/* Returns true if token `a` must run before token `b`. Simultaneous events
+ * run in token order. */
+static bool gb_sync_before(const struct gb_sync *sync, unsigned a, unsigned b) {
+     int32_t ea = sync->next_event[a];
+     int32_t eb = sync->next_event[b];
+
+     return ea < eb || (ea == eb && a < b);
+}
+
+static void gb_sync_heap_swap(struct gb_sync *sync, unsigned i, unsigned j) {
+     uint8_t t = sync->heap[i];
+
+     sync->heap[i] = sync->heap[j];
+     sync->heap[j] = t;
+
+     sync->heap_pos[sync->heap[i]] = i;
+     sync->heap_pos[sync->heap[j]] = j;
+}
+
+/* Move the token at `pos` in the heap to its place after its next_event
+ * changed */
+static void gb_sync_heap_fix(struct gb_sync *sync, unsigned pos) {
+     while (pos > 0) {
+          unsigned parent = (pos - 1) / 2;
+
+          if (!gb_sync_before(sync, sync->heap[pos], sync->heap[parent])) {
+               break;
+          }
+
+          gb_sync_heap_swap(sync, pos, parent);
+          pos = parent;
+     }
+
+     for (;;) {
+          unsigned left = pos * 2 + 1;
+          unsigned right = left + 1;
+          unsigned first = pos;
+
+          if (left < GB_SYNC_NUM &&
+              gb_sync_before(sync, sync->heap[left], sync->heap[first])) {
+               first = left;
+          }
+
+          if (right < GB_SYNC_NUM &&
+              gb_sync_before(sync, sync->heap[right], sync->heap[first])) {
+               first = right;
+          }
+
+          if (first == pos) {
+               break;
+          }
+
+          gb_sync_heap_swap(sync, pos, first);
+          pos = first;
+     }
+}
+
 int32_t gb_sync_resync(struct gb *gb, enum gb_sync_token token) {
      struct gb_sync *sync = &gb->sync;
      int32_t elapsed = gb->timestamp - sync->last_sync[token];
@@ -30,19 +95,12 @@ int32_t gb_sync_resync(struct gb *gb, enum gb_sync_token token) {
 
 void gb_sync_next(struct gb *gb, enum gb_sync_token token, int32_t cycles) {
      struct gb_sync *sync = &gb->sync;
-     unsigned i;
 
      sync->next_event[token] = gb->timestamp + cycles;
 
-     /* Recompute the date of the first event to come */
-     sync->first_event = sync->next_event[0];
+     gb_sync_heap_fix(sync, sync->heap_pos[token]);
 
-     for (i = 1; i < GB_SYNC_NUM; i++) {
-          int32_t e = sync->next_event[i];
-          if (e < sync->first_event) {
-               sync->first_event = e;
-          }
-     }
+     sync->first_event = sync->next_event[sync->heap[0]];
 }
 
 void gb_sync_check_events(struct gb *gb) {
@@ -52,27 +110,15 @@ void gb_sync_check_events(struct gb *gb) {
       * timestamp counter (in particular the HDMA running on HSYNC). Therefore
       * we have to recheck for a potential event in a loop to make sure we only
       * return control to the caller when all events have been processed. */
-     while (gb->timestamp >= gb->sync.first_event) {
-          int32_t ts = gb->timestamp;
-
-          if (ts >= sync->next_event[GB_SYNC_GPU]) {
-               gb_gpu_sync(gb);
-          }
-
-          if (ts >= sync->next_event[GB_SYNC_DMA]) {
-               gb_dma_sync(gb);
-          }
-
-          if (ts >= sync->next_event[GB_SYNC_TIMER]) {
-               gb_timer_sync(gb);
-          }
-
-          if (ts >= sync->next_event[GB_SYNC_SPU]) {
-               gb_spu_sync(gb);
-          }
-
-          if (ts >= sync->next_event[GB_SYNC_CART]) {
-               gb_cart_sync(gb);
+     while (gb->timestamp >= sync->first_event) {
+          enum gb_sync_token token = sync->heap[0];
+          gb_sync_callback_f callback = sync->callbacks[token];
+
+          if (callback) {
+               callback(gb);
+          } else {
+               /* Nobody registered this token */
+               gb_sync_next(gb, token, GB_SYNC_NEVER);
           }
      }
 }
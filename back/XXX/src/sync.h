@@ -15,6 +15,10 @@ enum gb_sync_token {
      GB_SYNC_NUM
 };
 
+/* Function called when the event of a token is due. It must synchronize the
+ * device and call gb_sync_next to schedule its next event. */
+typedef void (*gb_sync_callback_f)(struct gb *gb);
+
 struct gb_sync {
      /* Smallest value in next_event */
      int32_t first_event;
@@ -22,9 +26,20 @@ struct gb_sync {
      int32_t last_sync[GB_SYNC_NUM];
      /* Value of the timestamp the next time this token must be synchronized */
      int32_t next_event[GB_SYNC_NUM];
+     /* Callback registered by the device owning each token */
+     gb_sync_callback_f callbacks[GB_SYNC_NUM];
+     /* Binary min-heap of all the tokens ordered by next_event, the first one
+      * is the next to run */
+     uint8_t heap[GB_SYNC_NUM];
+     /* Position of each token in `heap` */
+     uint8_t heap_pos[GB_SYNC_NUM];
 };
 
+/* Reset the event dates. Registered callbacks are kept. */
 void gb_sync_reset(struct gb *gb);
+/* Set the function called when the event of `token` is due */
+void gb_sync_register(struct gb *gb, enum gb_sync_token token,
+                      gb_sync_callback_f callback);
 
 /* Resynchronize the given token and return the number of cycles since the last
  * synchronization */
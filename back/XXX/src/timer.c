@@ -4,6 +4,8 @@
 void gb_timer_reset(struct gb *gb) {
      struct gb_timer *timer = &gb->timer;
 
+     gb_sync_register(gb, GB_SYNC_TIMER, gb_timer_sync);
+
      timer->divider_counter = 0;
      timer->counter = 0;
      timer->modulo = 0;